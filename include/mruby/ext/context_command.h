@@ -0,0 +1,27 @@
+#ifndef MRUBY_CONTEXT_COMMAND_H
+#define MRUBY_CONTEXT_COMMAND_H
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "context.h"
+
+/*
+ * Binary scheduler commands. A command is an opcode plus an argument array,
+ * both crossing threads encoded by context_value_dump(), as does the result.
+ * Handlers registered here run natively on the thread calling
+ * ThreadScheduler.execute, with its mrb_state; opcodes without one are
+ * yielded to the Ruby handlers (ThreadScheduler.handle).
+ */
+
+#define CONTEXT_COMMAND_MAX_OPCODE 255
+
+typedef mrb_value (*context_command_handler)(mrb_state *mrb, mrb_int opcode, mrb_value args, void *data);
+
+int context_command_register(mrb_int opcode, context_command_handler handler, void *data);
+
+#if defined(__cplusplus)
+} /* extern "C" { */
+#endif
+#endif /* MRUBY_CONTEXT_COMMAND_H */
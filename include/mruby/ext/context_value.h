@@ -0,0 +1,41 @@
+#ifndef MRUBY_CONTEXT_VALUE_H
+#define MRUBY_CONTEXT_VALUE_H
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "context.h"
+
+/*
+ * Compact binary encoding for values crossing mrb_state boundaries. Each
+ * value is a tag byte followed by its payload (integers little endian):
+ *
+ * 'n' nil, 't' true, 'f' false
+ * 'i' int64
+ * 'd' IEEE 754 double
+ * 's' uint32 length + bytes (string)
+ * 'y' uint32 length + bytes (symbol name)
+ * 'a' uint32 count + values
+ * 'h' uint32 count + key/value pairs
+ *
+ * Anything else (or nesting deeper than CONTEXT_VALUE_MAX_DEPTH) is encoded
+ * as nil and counted as lost.
+ *
+ * Results handed over between states (mrb_eval, mrb_eval_async, binary
+ * commands) are checked with context_value_transferable first: a top level
+ * value that isn't transferable arrives as true (the snippet ran, but its
+ * result can't be copied), while one nested in an array or hash arrives as
+ * nil. Context::Value.dump raises TypeError for either.
+ */
+
+#define CONTEXT_VALUE_MAX_DEPTH 64
+
+int context_value_transferable(mrb_value value);
+int context_value_dump(mrb_state *mrb, mrb_value value, char **buf, size_t *len);
+mrb_value context_value_load(mrb_state *mrb, const char *buf, size_t len);
+
+#if defined(__cplusplus)
+} /* extern "C" { */
+#endif
+#endif /* MRUBY_CONTEXT_VALUE_H */
@@ -45,11 +45,31 @@ class Context
     end
 
     def self.channels
-      CHANNELS || @channels
+      @channels ||= CHANNELS.dup
+    end
+
+    # Creates a channel, with its own lock and queue, shared by every
+    # instance (the same name always refers to the same channel).
+    def self.create(channel, capacity = 1024)
+      channels[channel] = _create(channel.to_s, capacity)
+    end
+
+    # Backed by a shared memory ring (see context_shm_ring.c), so another
+    # process opening the same path reaches the same channel. Each direction
+    # takes a single writer and a single reader process; messages are read
+    # oldest first and event ids are carried but not matched.
+    def self.create_shared(channel, path = channel.to_s, size = 65536)
+      channels[channel] = _create_shared(channel.to_s, path, size)
+    end
+
+    # Blocks until there's a message on the channel, up to timeout
+    # milliseconds (forever when negative).
+    def self.wait(channel, timeout = -1)
+      _wait(internal_channel(channel), timeout)
     end
 
     def self.internal_channel(channel)
-      value = channels[channel]
+      value = channels[channel] || (channels[channel] = _find(channel.to_s))
       raise ChannelNotFound.new("channel #{channel.inspect} not found") unless value
       value
     end
@@ -58,8 +78,7 @@ class Context
       if Context::ThreadScheduler.communication_thread?
         id
       else
-        time = Time.now.to_i.to_s[-6..-1].to_i
-        @id = time + rand(99999)
+        @id = _generate_id
       end
     end
 
@@ -71,5 +90,26 @@ class Context
       @id, buf = _read(1, internal_channel(channel), event_id)
       buf
     end
+
+    # Oldest first, as [event_id, buf] pairs.
+    def self.drain(channel, max = 1024)
+      _drain(internal_channel(channel), max)
+    end
+
+    # All payloads share the same event id, returns how many were written.
+    def self.write_batch(channel, payloads, event_id = nil)
+      _write_batch(internal_channel(channel), event_id || generate_id, payloads)
+    end
+
+    # Typed payloads (nil, booleans, numbers, strings, symbols, arrays and
+    # hashes), encoded with Context::Value instead of inspect/eval.
+    def self.write_value(channel, value, event_id = nil)
+      write(channel, Context::Value.dump(value), event_id)
+    end
+
+    def self.read_value(channel, event_id = id)
+      buf = read(channel, event_id)
+      Context::Value.load(buf) if buf
+    end
   end
 end
@@ -1,15 +1,34 @@
 class Context
   class ThreadPubSub
-    def self.publish(text, avoid_id = nil)
-      _publish(text, avoid_id || @subscribed_id)
+    DEFAULT_TOPIC = :default
+    POLICIES      = { :drop_oldest => 0, :drop_newest => 1 }
+
+    # Delivers text to every subscriber of the topic but avoid_id (the
+    # caller's own subscription, by default).
+    def self.publish(text, avoid_id = nil, topic = DEFAULT_TOPIC)
+      _publish(topic.to_s, text, avoid_id || @subscribed_id) > 0
     end
 
     def self.listen(id)
       _listen(id)
     end
 
-    def self.subscribe
-      @subscribed_id = _subscribe
+    # Each subscriber gets its own queue of up to capacity events; when it
+    # is full, policy says which event is lost (:drop_oldest/:drop_newest).
+    def self.subscribe(topic = DEFAULT_TOPIC, capacity = 1024, policy = :drop_oldest)
+      id = _subscribe(topic.to_s, capacity, POLICIES[policy] || 0)
+      @subscribed_id = id if topic == DEFAULT_TOPIC
+      id
+    end
+
+    def self.unsubscribe(id)
+      @subscribed_id = nil if id == @subscribed_id
+      _unsubscribe(id)
+    end
+
+    # {:topic, :backlog, :capacity, :delivered, :dropped, :policy}
+    def self.stats(id)
+      _stats(id)
     end
   end
 end
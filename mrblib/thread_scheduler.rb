@@ -13,11 +13,17 @@ class ThreadScheduler
 
   INTERNAL_TO_EXTERNAL = EXTERNAL_TO_INTERNAL.invert
   NOT_CACHEABLE = ["code"]
+  # Milliseconds without execute before the communication thread is taken
+  # as stalled and restarted, 0 (default) to only restart it when it dies: a
+  # stalled thread can't be cancelled, so this is opt-in for connections
+  # known to never block that long.
+  COMMUNICATION_STALL_TIMEOUT = 0
 
   class << self
-    attr_accessor :status_bar, :communication, :cache
+    attr_accessor :status_bar, :communication, :cache, :stall_timeout
   end
   self.cache = Hash.new
+  self.stall_timeout = COMMUNICATION_STALL_TIMEOUT
 
   def self.start
     self.spawn_communication
@@ -38,24 +44,25 @@ class ThreadScheduler
     end
   end
 
+  # The communication thread is supervised once spawned: restarted whenever
+  # it dies, until stopped. Only needed when it was never spawned or stopped.
   def self.keep_alive
-    self.spawn_communication if self.die?(:communication)
+    if self.die?(:communication) && ! self.supervised?(:communication)
+      self.spawn_communication
+    end
   end
 
   def self.spawn_communication
     _start(THREAD_INTERNAL_COMMUNICATION)
     str = "Context.start('main', '#{Device.adapter}'); "
     str << "Context.execute('main', '#{Device.adapter}', '{\"initialize\":\"communication\"}')"
-    self.communication = Thread.new do
-      mrb_eval(str, 'thread_communication')
-      _stop(THREAD_INTERNAL_COMMUNICATION)
-    end
+    self.communication = _spawn(THREAD_INTERNAL_COMMUNICATION, str, self.stall_timeout.to_i)
   end
 
   def self.stop_communication
     if self.communication
       _stop(THREAD_INTERNAL_COMMUNICATION)
-      self.communication.join
+      _join(THREAD_INTERNAL_COMMUNICATION)
       self.communication = nil
     end
   end
@@ -80,9 +87,24 @@ class ThreadScheduler
     end
   end
 
+  def self.execute_binary(id = 0)
+    self._execute_binary(id) do |opcode, args|
+      begin
+        handler = handlers[opcode]
+        handler.call(*args) if handler
+      rescue => e
+        ContextLog.exception(e, e.backtrace, "Thread [#{opcode}] execution error")
+        nil
+      end
+    end
+  end
+
   # TODO Refactor to send mruby irep binary
   def self.execute(id = 0)
-    self._execute(id) do |str|
+    _heartbeat(THREAD_INTERNAL_COMMUNICATION)
+    # id is a command id, binary calls are run whatever their opcode
+    binary = self.execute_binary(0)
+    strings = self._execute(id) do |str|
       begin
         if str == "connect"
           (!! DaFunk::PaymentChannel.connect(false)).to_s
@@ -100,6 +122,64 @@ class ThreadScheduler
         "cache"
       end
     end
+    strings || binary
+  end
+
+  # Binary commands: an integer opcode and typed arguments, both ways encoded
+  # by Context::Value (no string parsing, no eval). Handlers registered here
+  # run on the thread calling execute, unless the opcode has a native one
+  # (context_command_register()).
+  def self.handle(opcode, &block)
+    handlers[opcode] = block
+  end
+
+  def self.handlers
+    @handlers ||= {}
+  end
+
+  # Result of opcode run with these very arguments, or nil while it hasn't
+  # run yet (the call is queued meanwhile, once). Every call has an ID of its
+  # own, so its result goes neither to other arguments nor other threads.
+  def self.call(opcode, *args)
+    buf = Context::Value.dump(args)
+    key = [opcode, buf]
+    if id = calls[key]
+      result = _call_result(id)
+      return if result.nil?
+      calls.delete(key)
+      return Context::Value.load(result) if result
+    end
+    calls[key] = _call(opcode, buf)
+    nil
+  end
+
+  # Calls waiting for their result, by opcode and encoded arguments.
+  def self.calls
+    @calls ||= {}
+  end
+
+  # Queues a command and returns a Request to wait on, which wakes up as
+  # soon as the response is stored (no "cache" polling).
+  def self.request(id, string, value = nil)
+    _request(id, value ? "#{string}=#{value}" : string, 0)
+  end
+
+  def self.request_call(opcode, *args)
+    _request(opcode, Context::Value.dump(args), 1)
+  end
+
+  class Request
+    # Response (decoded for binary commands), or nil when it doesn't arrive
+    # within timeout milliseconds. The response is taken out of the queue
+    # the first time, and kept by the request.
+    def value(timeout = -1)
+      return @value if @answered
+      return unless wait(timeout)
+      buf = _value
+      return unless buf
+      @answered = true
+      @value = binary? ? Context::Value.load(buf) : buf
+    end
   end
 
   def self.payment_channel
@@ -124,11 +204,84 @@ class ThreadScheduler
   end
 
   def self.pause!(thread)
-    _pause(EXTERNAL_TO_INTERNAL[thread])
+    id = thread_id(thread)
+    id ? _pause(id) : false
   end
 
   def self.continue!(thread)
-    _continue(EXTERNAL_TO_INTERNAL[thread])
+    id = thread_id(thread)
+    id ? _continue(id) : false
+  end
+
+  # Named workers: besides the status bar and communication threads, up to
+  # 14 live ones at a time (the slots of stopped or dead workers are reused
+  # once the registry is full), each with its own instance ("thread_<name>")
+  # and command queue. The snippet runs on a native thread, usually looping
+  # on serve.
+  #
+  # Spawned workers are supervised until stopped (stop!): run again, with an
+  # exponential backoff, when the snippet is over or, given stall_timeout
+  # (milliseconds), when they don't call heartbeat for that long.
+  def self.spawn(thread, code, stall_timeout = 0)
+    id = _register(thread.to_s)
+    if id < 0
+      raise ThreadScheduler::ThreadSchedulerNotFoundError.new("Thread '#{thread}' could not be registered")
+    end
+    _start(id)
+    _spawn(id, code, stall_timeout)
+  end
+
+  def self.heartbeat(thread)
+    id = thread_id(thread)
+    id ? _heartbeat(id) : false
+  end
+
+  def self.supervised?(thread)
+    id = thread_id(thread)
+    !! (id && _supervisor_stats(id)[:supervised])
+  end
+
+  # Restart counts, last failure ("exited" or "stalled"), time since the last
+  # heartbeat and current backoff (milliseconds) of every worker.
+  def self.supervisor_stats
+    workers.each_with_index.inject({}) do |stats, (name, id)|
+      stats[name] = _supervisor_stats(id)
+      stats
+    end
+  end
+
+  def self.stop!(thread)
+    id = thread_id(thread)
+    id ? _stop(id) : false
+  end
+
+  def self.workers
+    _workers.map(&:to_sym)
+  end
+
+  def self.thread_id(thread)
+    id = _find(thread.to_s)
+    id if id >= 0
+  end
+
+  # Runs the commands queued for a worker (id 0 for all of them), storing
+  # whatever the block returns as their responses.
+  def self.serve(thread, id = 0, &block)
+    worker = thread_id(thread) || -1
+    _heartbeat(worker)
+    self._execute(id, worker) do |str|
+      begin
+        block.call(str).to_s
+      rescue => e
+        ContextLog.exception(e, e.backtrace, "Thread [#{thread}] execution error")
+        "cache"
+      end
+    end
+  end
+
+  # Queues a command for a worker, see request.
+  def self.send_to(thread, id, string)
+    _request(id, string, 0, thread_id(thread) || -1)
   end
 
   def self.communication_thread?
@@ -159,7 +312,11 @@ class ThreadScheduler
     when :communication
       _parse(_check(THREAD_INTERNAL_COMMUNICATION, timeout))
     else
-      raise ThreadScheduler::ThreadSchedulerNotFoundError.new("Thread '#{thread}' not found on check")
+      id = thread_id(thread)
+      unless id
+        raise ThreadScheduler::ThreadSchedulerNotFoundError.new("Thread '#{thread}' not found on check")
+      end
+      _parse(_check(id, timeout))
     end
   end
 
@@ -0,0 +1,457 @@
+/**
+ * @file context_eval_pool.c
+ * @brief mruby-context asynchronous evaluation on native worker threads.
+ * @platform Pax Prolin
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026 CloudWalk, Inc.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mruby.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/ext/context.h"
+#include "mruby/ext/context_value.h"
+#include "mruby/string.h"
+
+/**********/
+/* Macros */
+/**********/
+
+#ifndef CONTEXT_EVAL_WORKERS
+#define CONTEXT_EVAL_WORKERS 2 /* native threads evaluating async snippets */
+#endif /* #ifndef CONTEXT_EVAL_WORKERS */
+
+/********************/
+/* Type definitions */
+/********************/
+
+/**
+ * @brief Asynchronous evaluation request. Shared by the worker running it and
+ * the `Context::EvalFuture` waiting for it, hence reference counted.
+ */
+typedef struct evalJob
+{
+  char *application;
+  char *code;
+  size_t len;
+  int refs;
+  int done;
+  char *result; /* encoded by context_value_dump() */
+  size_t resultLen;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct evalJob *next;
+} evalJob;
+
+typedef struct evalWorker
+{
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct evalJob *first;
+  struct evalJob *last;
+} evalWorker;
+
+/********************/
+/* Global variables */
+/********************/
+
+/* Static */
+
+static pthread_mutex_t pool_mutex;
+
+static int pool_started = 0; /* workers running, under pool_mutex */
+
+static evalWorker workers[CONTEXT_EVAL_WORKERS];
+
+/***********************/
+/* Function prototypes */
+/***********************/
+
+extern struct instance *context_instance_acquire(const char *application);
+
+extern void context_instance_release(struct instance *current);
+
+extern void context_instance_lock(struct instance *current);
+
+extern void context_instance_unlock(struct instance *current);
+
+extern mrb_state *context_instance_state(struct instance *current);
+
+extern mrb_value context_instance_eval(struct instance *current, const char *code, size_t len);
+
+extern uint32_t context_application_hash(const char *application);
+
+static void eval_job_free(mrb_state *mrb, void *ptr);
+
+/*********************/
+/* Private functions */
+/*********************/
+
+static const struct mrb_data_type eval_job_type = { "EvalFuture", eval_job_free };
+
+/**
+ * @brief Job conditions wait on CLOCK_MONOTONIC, so setting the terminal clock
+ * doesn't stretch or cut the timeouts of EvalFuture#wait.
+ */
+static void
+eval_job_cond_init(evalJob *job)
+{
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&job->cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static void
+eval_job_release(evalJob *job)
+{
+  if (job == NULL || __sync_sub_and_fetch(&job->refs, 1) > 0) return;
+
+  pthread_mutex_destroy(&job->mutex);
+  pthread_cond_destroy(&job->cond);
+  free(job->application);
+  free(job->code);
+  free(job->result);
+  free(job);
+}
+
+static void
+eval_job_free(mrb_state *mrb, void *ptr)
+{
+  eval_job_release((evalJob *) ptr);
+}
+
+/**
+ * @brief Keeps the result of a job outside of the instance state it was
+ * evaluated on, so the caller can pick it up from its own state. As with
+ * mrb_eval, objects that can't cross states are reported as true.
+ */
+static void
+eval_job_store(mrb_state *mrb, evalJob *job, mrb_value ret)
+{
+  if (mrb_undef_p(ret))
+    ret = mrb_nil_value();
+  else if (!context_value_transferable(ret))
+    ret = mrb_true_value();
+
+  if (context_value_dump(mrb, ret, &job->result, &job->resultLen) < 0)
+  {
+    job->result = NULL;
+    job->resultLen = 0;
+  }
+}
+static void *
+eval_worker_run(void *arg)
+{
+  evalWorker *worker = (evalWorker *) arg;
+  evalJob *job;
+  struct instance *current;
+  int ai;
+
+  while (1)
+  {
+    pthread_mutex_lock(&worker->mutex);
+
+    while (worker->first == NULL)
+    {
+      pthread_cond_wait(&worker->cond, &worker->mutex);
+    }
+
+    job = worker->first;
+    worker->first = job->next;
+    if (worker->first == NULL) worker->last = NULL;
+
+    pthread_mutex_unlock(&worker->mutex);
+
+    current = context_instance_acquire(job->application);
+
+    /* An instance that can't be opened leaves the job without result (nil) */
+    if (current != NULL)
+    {
+      context_instance_lock(current);
+
+      ai = mrb_gc_arena_save(context_instance_state(current));
+
+      eval_job_store(context_instance_state(current), job, context_instance_eval(current, job->code, job->len));
+
+      mrb_gc_arena_restore(context_instance_state(current), ai);
+
+      context_instance_unlock(current);
+
+      context_instance_release(current);
+    }
+
+    pthread_mutex_lock(&job->mutex);
+
+    job->done = 1;
+
+    pthread_cond_broadcast(&job->cond);
+
+    pthread_mutex_unlock(&job->mutex);
+
+    eval_job_release(job);
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Starts the workers not running yet. After a failure, the next call
+ * resumes from the first worker that couldn't be started, so running workers
+ * are never initialized twice.
+ *
+ * @return 1 when every worker runs or 0, otherwise
+ */
+static int
+eval_pool_start(void)
+{
+  int i, ret;
+
+  pthread_mutex_lock(&pool_mutex);
+
+  for (i = pool_started; i < CONTEXT_EVAL_WORKERS; i++)
+  {
+    pthread_mutex_init(&workers[i].mutex, NULL);
+    pthread_cond_init(&workers[i].cond, NULL);
+
+    workers[i].first = NULL;
+    workers[i].last = NULL;
+
+    if (pthread_create(&workers[i].thread, NULL, eval_worker_run, &workers[i]) != 0)
+    {
+      pthread_mutex_destroy(&workers[i].mutex);
+      pthread_cond_destroy(&workers[i].cond);
+
+      break;
+    }
+
+    pthread_detach(workers[i].thread);
+
+    pool_started = i + 1;
+  }
+
+  ret = (pool_started == CONTEXT_EVAL_WORKERS);
+
+  pthread_mutex_unlock(&pool_mutex);
+
+  return ret;
+}
+
+/**
+ * @brief Queues a job on the worker owning its application. An application
+ * always goes to the same worker, so async jobs on an instance run in order;
+ * evaluations from any other thread (mrb_eval included) are kept apart by the
+ * instance lock the worker takes.
+ */
+static void
+eval_pool_submit(evalJob *job)
+{
+  evalWorker *worker;
+
+  worker = &workers[context_application_hash(job->application) % CONTEXT_EVAL_WORKERS];
+
+  pthread_mutex_lock(&worker->mutex);
+
+  if (worker->last != NULL)
+    worker->last->next = job;
+  else
+    worker->first = job;
+
+  worker->last = job;
+
+  pthread_cond_signal(&worker->cond);
+
+  pthread_mutex_unlock(&worker->mutex);
+}
+
+/**
+ * @brief Waits for a job to be done.
+ *
+ * @param job given job
+ * @param timeout_msec timeout in milliseconds, negative to wait forever
+ *
+ * @return 1 when done or 0, otherwise
+ */
+static int
+eval_job_wait(evalJob *job, mrb_int timeout_msec)
+{
+  struct timespec deadline;
+  int done;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+  if (timeout_msec > 0)
+  {
+    deadline.tv_sec += timeout_msec / 1000;
+    deadline.tv_nsec += (timeout_msec % 1000) * 1000000;
+
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
+  pthread_mutex_lock(&job->mutex);
+
+  while (!job->done && timeout_msec != 0)
+  {
+    if (timeout_msec < 0)
+      pthread_cond_wait(&job->cond, &job->mutex);
+    else if (pthread_cond_timedwait(&job->cond, &job->mutex, &deadline) == ETIMEDOUT)
+      break;
+  }
+
+  done = job->done;
+
+  pthread_mutex_unlock(&job->mutex);
+
+  return done;
+}
+
+/**************************/
+/* Externalized functions */
+/**************************/
+
+static mrb_value
+mrb_mrb_eval_async(mrb_state *mrb, mrb_value self)
+{
+  mrb_value code, application, future;
+  const char *name;
+  evalJob *job;
+
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "SS", &code, &application);
+
+  name = mrb_string_value_cstr(mrb, &application);
+
+  if (!eval_pool_start())
+  {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "could not start mrb_eval workers");
+  }
+
+  job = (evalJob *) calloc(1, sizeof(evalJob));
+
+  if (job == NULL)
+  {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "could not allocate mrb_eval job");
+  }
+
+  job->application = strdup(name);
+  job->code = (char *) malloc(RSTRING_LEN(code) + 1);
+  job->len = RSTRING_LEN(code);
+  job->refs = 1;
+
+  pthread_mutex_init(&job->mutex, NULL);
+  eval_job_cond_init(job);
+
+  if (job->application == NULL || job->code == NULL)
+  {
+    eval_job_release(job);
+
+    mrb_raise(mrb, E_RUNTIME_ERROR, "could not allocate mrb_eval job");
+  }
+
+  memcpy(job->code, RSTRING_PTR(code), job->len);
+  job->code[job->len] = 0;
+
+  /* The future owns the first reference, the worker takes the second one */
+  future = mrb_obj_value(mrb_data_object_alloc(mrb, mrb_class_get_under(mrb, mrb_class_get(mrb, "Context"), "EvalFuture"), job, &eval_job_type));
+
+  __sync_add_and_fetch(&job->refs, 1);
+
+  eval_pool_submit(job);
+
+  TRACE("return");
+
+  return future;
+}
+
+static mrb_value
+mrb_eval_future_ready(mrb_state *mrb, mrb_value self)
+{
+  evalJob *job = (evalJob *) mrb_data_get_ptr(mrb, self, &eval_job_type);
+
+  return mrb_bool_value(job != NULL && eval_job_wait(job, 0));
+}
+
+static mrb_value
+mrb_eval_future_wait(mrb_state *mrb, mrb_value self)
+{
+  mrb_int timeout = -1;
+  evalJob *job = (evalJob *) mrb_data_get_ptr(mrb, self, &eval_job_type);
+
+  mrb_get_args(mrb, "|i", &timeout);
+
+  if (job == NULL) return mrb_false_value();
+
+  return mrb_bool_value(eval_job_wait(job, timeout));
+}
+
+static mrb_value
+mrb_eval_future_value(mrb_state *mrb, mrb_value self)
+{
+  mrb_value value;
+  evalJob *job = (evalJob *) mrb_data_get_ptr(mrb, self, &eval_job_type);
+
+  if (job == NULL) return mrb_nil_value();
+
+  eval_job_wait(job, -1);
+
+  if (job->result == NULL) return mrb_nil_value();
+
+  value = context_value_load(mrb, job->result, job->resultLen);
+
+  return mrb_undef_p(value) ? mrb_nil_value() : value;
+}
+
+/********************/
+/* Public functions */
+/********************/
+
+extern void
+mrb_context_eval_pool_init(mrb_state *mrb)
+{
+  static int mutex_init = 0;
+
+  struct RClass *krn;
+  struct RClass *context;
+  struct RClass *eval_future;
+
+  TRACE_FUNCTION();
+
+  if (!mutex_init)
+  {
+    pthread_mutex_init(&pool_mutex, NULL);
+
+    mutex_init = 1;
+  }
+
+  krn = mrb->kernel_module;
+
+  context     = mrb_define_class(mrb, "Context", mrb->object_class);
+
+  eval_future = mrb_define_class_under(mrb, context, "EvalFuture", mrb->object_class);
+
+  MRB_SET_INSTANCE_TT(eval_future, MRB_TT_DATA);
+
+  mrb_define_method(mrb , krn         , "mrb_eval_async" , mrb_mrb_eval_async    , MRB_ARGS_REQ(2));
+
+  mrb_define_method(mrb , eval_future , "ready?"         , mrb_eval_future_ready , MRB_ARGS_NONE());
+  mrb_define_method(mrb , eval_future , "wait"           , mrb_eval_future_wait  , MRB_ARGS_OPT(1));
+  mrb_define_method(mrb , eval_future , "value"          , mrb_eval_future_value , MRB_ARGS_NONE());
+
+  TRACE("return");
+}
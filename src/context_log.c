@@ -15,7 +15,7 @@ void ContextLog(mrb_state *mrb, int severity_level, const char *format, ...)
   va_list argptr;
 
   va_start(argptr, format);
-  vsprintf(dest, format, argptr);
+  vsnprintf(dest, sizeof(dest), format, argptr);
   va_end(argptr);
 
   mrb_value msg, context;
@@ -34,11 +34,12 @@ void ContextLogFile(const char *format, ...)
   FILE *pFile;
 
   va_start(argptr, format);
-  vsprintf(dest, format, argptr);
+  vsnprintf(dest, sizeof(dest), format, argptr);
   /*sprintf(dest, "%s\n", dest);*/
   va_end(argptr);
 
   pFile = fopen("main/debug.log", "a");
+  if (pFile == NULL) return;
   fwrite(dest, strlen(dest), 1, pFile);
   fclose(pFile);
 }
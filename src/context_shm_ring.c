@@ -0,0 +1,375 @@
+/**
+ * @file context_shm_ring.c
+ * @brief mruby-context shared memory byte ring (ThreadChannel transport
+ * across processes).
+ * @platform Pax Prolin
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026 CloudWalk, Inc.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif /* #ifndef _WIN32 */
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif /* #ifdef __linux__ */
+
+#include "mruby.h"
+#include "mruby/ext/context.h"
+
+/**********/
+/* Macros */
+/**********/
+
+#ifndef CONTEXT_SHM_DIR
+#define CONTEXT_SHM_DIR "/dev/shm" /* tmpfs, for names not starting with '/' */
+#endif /* #ifndef CONTEXT_SHM_DIR */
+
+#define SHM_RING_DATA 64           /* data offset (header on its own line) */
+#define SHM_RING_MAGIC 0x43545852  /* "CTXR" */
+#define SHM_RING_MAX_SIZE (16 * 1024 * 1024)
+#define SHM_RING_MIN_SIZE 4096
+#define SHM_RING_RECORD 8          /* record header: length and event ID */
+#define SHM_RING_ALIGN(n) (((n) + 7) & ~7U)
+
+/********************/
+/* Type definitions */
+/********************/
+
+/**
+ * @brief Mapped at the beginning of the segment. Head and tail are free
+ * running byte counters, written only by the producer and the consumer,
+ * respectively. Every write bumps seq, the futex word waiters sleep on.
+ */
+typedef struct shmRingHeader
+{
+  uint32_t magic;
+  uint32_t size; /* data bytes, power of two */
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  volatile int seq;
+  volatile int waiters;
+} shmRingHeader;
+
+typedef struct shmRing
+{
+  shmRingHeader *header;
+  unsigned char *data;
+  size_t mapped;
+  uint32_t size; /* header size, checked against the mapping once */
+} shmRing;
+
+/*********************/
+/* Private functions */
+/*********************/
+
+static void
+shm_ring_sleep(volatile int *word, int value, int timeout_msec)
+{
+  struct timespec ts;
+
+  ts.tv_sec = timeout_msec / 1000;
+  ts.tv_nsec = (timeout_msec % 1000) * 1000000L;
+
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAIT, value, (timeout_msec < 0) ? NULL : &ts, NULL, 0);
+#else
+  (void) word;
+  (void) value;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = 1000000L; /* no futex: poll every millisecond */
+
+  nanosleep(&ts, NULL);
+#endif /* #ifdef __linux__ */
+}
+
+static void
+shm_ring_wake(volatile int *word)
+{
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+  (void) word;
+#endif /* #ifdef __linux__ */
+}
+
+static void
+shm_ring_copy_in(shmRing *ring, uint32_t pos, const void *buf, uint32_t len)
+{
+  uint32_t offset = pos & (ring->size - 1);
+  uint32_t first = ring->size - offset;
+
+  if (first > len) first = len;
+
+  memcpy(ring->data + offset, buf, first);
+  memcpy(ring->data, (const unsigned char *) buf + first, len - first);
+}
+
+static void
+shm_ring_copy_out(shmRing *ring, uint32_t pos, void *buf, uint32_t len)
+{
+  uint32_t offset = pos & (ring->size - 1);
+  uint32_t first = ring->size - offset;
+
+  if (first > len) first = len;
+
+  memcpy(buf, ring->data + offset, first);
+  memcpy((unsigned char *) buf + first, ring->data, len - first);
+}
+
+static unsigned long long
+shm_ring_clock_msec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/********************/
+/* Public functions */
+/********************/
+
+/**
+ * @brief Maps a shared ring, creating it when needed. Every process opening
+ * the same name sees the same ring. Names starting with '/' are file paths,
+ * other ones live in @link CONTEXT_SHM_DIR @endlink.
+ *
+ * @param name ring name
+ * @param size data size, rounded up to a power of two (ignored when the ring
+ * already exists)
+ *
+ * @return ring or NULL, on failure
+ */
+extern shmRing *
+context_shm_ring_open(const char *name, size_t size)
+{
+#ifdef _WIN32
+  (void) name;
+  (void) size;
+
+  return NULL;
+#else
+  char path[256];
+  struct stat st;
+  shmRing *ring;
+  uint32_t data = SHM_RING_MIN_SIZE;
+  void *map;
+  int fd, retries = 1000;
+
+  while (data < size && data < SHM_RING_MAX_SIZE) data <<= 1;
+
+  if (name[0] == '/')
+    snprintf(path, sizeof(path), "%s", name);
+  else
+    snprintf(path, sizeof(path), "%s/mruby-context-%s", CONTEXT_SHM_DIR, name);
+
+  fd = open(path, O_RDWR | O_CREAT, 0600);
+
+  if (fd < 0) return NULL;
+
+  /* The first process to open the file sizes it, any other one uses it as is */
+  if (fstat(fd, &st) != 0 || (st.st_size == 0 && ftruncate(fd, SHM_RING_DATA + data) != 0) || fstat(fd, &st) != 0)
+  {
+    close(fd);
+
+    return NULL;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  close(fd);
+
+  if (map == MAP_FAILED) return NULL;
+
+  ring = (shmRing *) calloc(1, sizeof(shmRing));
+
+  if (ring == NULL)
+  {
+    munmap(map, st.st_size);
+
+    return NULL;
+  }
+
+  ring->header = (shmRingHeader *) map;
+  ring->data = (unsigned char *) map + SHM_RING_DATA;
+  ring->mapped = st.st_size;
+
+  /* Claims initialization, or waits for whoever claimed it */
+  if (__sync_bool_compare_and_swap(&ring->header->size, 0, (uint32_t) (st.st_size - SHM_RING_DATA)))
+  {
+    ring->header->head = 0;
+    ring->header->tail = 0;
+    ring->header->seq = 0;
+    ring->header->waiters = 0;
+
+    __sync_synchronize();
+
+    ring->header->magic = SHM_RING_MAGIC;
+  }
+
+  while (((volatile shmRingHeader *) ring->header)->magic != SHM_RING_MAGIC && retries-- > 0)
+  {
+    shm_ring_sleep(&ring->header->seq, ring->header->seq, 1);
+  }
+
+  ring->size = ring->header->size;
+
+  /* A stale or racing file may have been sized otherwise than its header says */
+  if (ring->header->magic != SHM_RING_MAGIC || ring->size == 0 || (ring->size & (ring->size - 1)) != 0 || (size_t) ring->size + SHM_RING_DATA > ring->mapped)
+  {
+    munmap(map, ring->mapped);
+
+    free(ring);
+
+    return NULL;
+  }
+
+  return ring;
+#endif /* #ifdef _WIN32 */
+}
+
+/**
+ * @brief Appends a record. A ring has a single producer: callers writing
+ * from several threads of the same process must serialize themselves.
+ *
+ * @return payload length or 0, when there's no room left
+ */
+extern int
+context_shm_ring_write(shmRing *ring, int id, const char *buf, int len)
+{
+  shmRingHeader *header = ring->header;
+  uint32_t record[2];
+  uint32_t head = header->head;
+  uint32_t size = SHM_RING_RECORD + SHM_RING_ALIGN((uint32_t) len);
+
+  if (len <= 0 || (uint32_t) len > ring->size || size > ring->size - (head - header->tail)) return 0;
+
+  record[0] = (uint32_t) len;
+  record[1] = (uint32_t) id;
+
+  shm_ring_copy_in(ring, head, record, SHM_RING_RECORD);
+  shm_ring_copy_in(ring, head + SHM_RING_RECORD, buf, len);
+
+  __sync_synchronize(); /* record visible before the new head */
+
+  header->head = head + size;
+
+  __sync_add_and_fetch(&header->seq, 1);
+
+  if (header->waiters) shm_ring_wake(&header->seq);
+
+  return len;
+}
+
+/**
+ * @brief Length of the oldest record. The header is written by another
+ * process, so it's checked against what was actually written: a corrupt
+ * record drops everything written so far.
+ *
+ * @param id event ID of the record
+ *
+ * @return payload length or 0, when the ring is empty
+ */
+extern int
+context_shm_ring_peek(shmRing *ring, int *id)
+{
+  shmRingHeader *header = ring->header;
+  uint32_t record[2];
+  uint32_t tail = header->tail;
+  uint32_t head = header->head;
+
+  if (tail == head) return 0;
+
+  __sync_synchronize(); /* head read before the record */
+
+  shm_ring_copy_out(ring, tail, record, SHM_RING_RECORD);
+
+  if (head - tail > ring->size || record[0] == 0 || record[0] > ring->size || SHM_RING_RECORD + SHM_RING_ALIGN(record[0]) > head - tail)
+  {
+    header->tail = head;
+
+    return 0;
+  }
+
+  if (id != NULL) *id = (int) record[1];
+
+  return (int) record[0];
+}
+
+/**
+ * @brief Takes the oldest record (see @link context_shm_ring_peek @endlink,
+ * which must be called first), copying its payload once. A ring has a single
+ * consumer.
+ *
+ * @param buf payload buffer, as large as the peeked length
+ */
+extern void
+context_shm_ring_take(shmRing *ring, char *buf)
+{
+  shmRingHeader *header = ring->header;
+  uint32_t record[2];
+  uint32_t tail = header->tail;
+
+  shm_ring_copy_out(ring, tail, record, SHM_RING_RECORD);
+
+  shm_ring_copy_out(ring, tail + SHM_RING_RECORD, buf, record[0]);
+
+  __sync_synchronize(); /* record read before the new tail */
+
+  header->tail = tail + SHM_RING_RECORD + SHM_RING_ALIGN(record[0]);
+}
+
+/**
+ * @brief Waits for a record to be available.
+ *
+ * @param ring given ring
+ * @param timeout_msec timeout in milliseconds, negative to wait forever
+ *
+ * @return 1 when there's a record to read or 0, otherwise
+ */
+extern int
+context_shm_ring_wait(shmRing *ring, int timeout_msec)
+{
+  shmRingHeader *header = ring->header;
+  unsigned long long deadline = shm_ring_clock_msec() + ((timeout_msec > 0) ? timeout_msec : 0);
+  long long remaining = timeout_msec;
+  int seq;
+
+  while (1)
+  {
+    seq = header->seq;
+
+    if (header->tail != header->head) return 1;
+
+    if (timeout_msec >= 0)
+    {
+      remaining = (long long) deadline - (long long) shm_ring_clock_msec();
+
+      if (remaining <= 0) return 0;
+    }
+
+    __sync_add_and_fetch(&header->waiters, 1);
+
+    shm_ring_sleep(&header->seq, seq, (int) remaining);
+
+    __sync_sub_and_fetch(&header->waiters, 1);
+  }
+}
@@ -0,0 +1,175 @@
+/**
+ * @file context_slab.c
+ * @brief mruby-context size-class slab allocator (small VM objects).
+ * @platform Pax Prolin
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026 CloudWalk, Inc.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mruby.h"
+#include "mruby/ext/context.h"
+
+/**********/
+/* Macros */
+/**********/
+
+/* Chunks go back to libc only when the slab is destroyed (with its state):
+ * freed blocks are reused by the state, so an instance keeps its peak small
+ * object memory while it lives (Vm.stats[:slab_chunks]). */
+#ifndef CONTEXT_SLAB_CHUNK_SIZE
+#define CONTEXT_SLAB_CHUNK_SIZE 16384 /* bytes taken from libc at once */
+#endif /* #ifndef CONTEXT_SLAB_CHUNK_SIZE */
+
+#define SLAB_CLASSES 4 /* 32, 64, 128 and 256 byte blocks */
+#define SLAB_MIN_SHIFT 5
+
+/********************/
+/* Type definitions */
+/********************/
+
+typedef struct slabBlock
+{
+  struct slabBlock *next;
+} slabBlock;
+
+typedef struct slabChunk
+{
+  struct slabChunk *next;
+  union /* union for alignment */
+  {
+    void *ptr;
+    long long l;
+    double d;
+  } data[1];
+} slabChunk;
+
+typedef struct contextSlab
+{
+  slabBlock *free[SLAB_CLASSES];
+  slabChunk *chunks;
+  unsigned int chunk_cnt;
+} contextSlab;
+
+/*********************/
+/* Private functions */
+/*********************/
+
+static int
+slab_refill(contextSlab *slab, int class)
+{
+  size_t size = (size_t) 1 << (class + SLAB_MIN_SHIFT);
+  size_t offset = offsetof(slabChunk, data);
+  slabChunk *chunk;
+  slabBlock *block;
+
+  chunk = (slabChunk *) malloc(CONTEXT_SLAB_CHUNK_SIZE);
+
+  if (chunk == NULL) return 0;
+
+  chunk->next = slab->chunks;
+  slab->chunks = chunk;
+  slab->chunk_cnt++;
+
+  while (offset + size <= CONTEXT_SLAB_CHUNK_SIZE)
+  {
+    block = (slabBlock *) ((char *) chunk + offset);
+    block->next = slab->free[class];
+    slab->free[class] = block;
+    offset += size;
+  }
+
+  return 1;
+}
+
+/********************/
+/* Public functions */
+/********************/
+
+/**
+ * @brief Size class of a block, or -1 when too large for the slab.
+ */
+extern int
+context_slab_class(size_t size)
+{
+  int class = 0;
+
+  while (class < SLAB_CLASSES && size > ((size_t) 1 << (class + SLAB_MIN_SHIFT)))
+  {
+    class++;
+  }
+
+  return (class < SLAB_CLASSES) ? class : -1;
+}
+
+extern contextSlab *
+context_slab_new(void)
+{
+  return (contextSlab *) calloc(1, sizeof(contextSlab));
+}
+
+/**
+ * @brief Takes a block from a size class, carving a new chunk when needed.
+ *
+ * @param slab given slab
+ * @param class size class (@link context_slab_class @endlink)
+ *
+ * @return block or NULL, when out of memory
+ */
+extern void *
+context_slab_alloc(contextSlab *slab, int class)
+{
+  slabBlock *block;
+
+  if (slab->free[class] == NULL && !slab_refill(slab, class)) return NULL;
+
+  block = slab->free[class];
+  slab->free[class] = block->next;
+
+  return block;
+}
+
+extern void
+context_slab_free(contextSlab *slab, int class, void *ptr)
+{
+  slabBlock *block = (slabBlock *) ptr;
+
+  block->next = slab->free[class];
+  slab->free[class] = block;
+}
+
+/**
+ * @brief Releases every chunk at once (blocks still in use included).
+ */
+extern void
+context_slab_destroy(contextSlab *slab)
+{
+  slabChunk *chunk, *next;
+
+  if (slab == NULL) return;
+
+  chunk = slab->chunks;
+
+  while (chunk != NULL)
+  {
+    next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+
+  free(slab);
+}
+
+/**
+ * @brief Chunks taken from libc so far (none are released before @link
+ * context_slab_destroy @endlink).
+ */
+extern unsigned int
+context_slab_chunks(const contextSlab *slab)
+{
+  return (slab) ? slab->chunk_cnt : 0;
+}
@@ -0,0 +1,471 @@
+/**
+ * @file context_value.c
+ * @brief mruby-context value codec (cross-instance transfers).
+ * @platform Pax Prolin
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026 CloudWalk, Inc.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/ext/context.h"
+#include "mruby/ext/context_value.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+
+/**********/
+/* Macros */
+/**********/
+
+#define VALUE_NIL    'n'
+#define VALUE_TRUE   't'
+#define VALUE_FALSE  'f'
+#define VALUE_INT    'i'
+#define VALUE_FLOAT  'd'
+#define VALUE_STRING 's'
+#define VALUE_SYMBOL 'y'
+#define VALUE_ARRAY  'a'
+#define VALUE_HASH   'h'
+
+/********************/
+/* Type definitions */
+/********************/
+
+typedef struct valueWriter
+{
+  char *ptr;
+  size_t len;
+  size_t capa;
+  int lost;
+  int failed;
+} valueWriter;
+
+typedef struct valueReader
+{
+  const uint8_t *ptr;
+  size_t len;
+  size_t pos;
+  int failed;
+} valueReader;
+
+/*********************/
+/* Private functions */
+/*********************/
+
+static void
+value_write(valueWriter *w, const void *data, size_t len)
+{
+  char *ptr;
+  size_t capa;
+
+  if (w->failed) return;
+
+  if (w->len + len > w->capa)
+  {
+    capa = (w->capa) ? w->capa : 64;
+
+    while (capa < w->len + len) capa *= 2;
+
+    ptr = (char *) realloc(w->ptr, capa);
+
+    if (ptr == NULL)
+    {
+      w->failed = 1;
+
+      return;
+    }
+
+    w->ptr = ptr;
+    w->capa = capa;
+  }
+
+  memcpy(w->ptr + w->len, data, len);
+
+  w->len += len;
+}
+
+static void
+value_write_tag(valueWriter *w, char tag)
+{
+  value_write(w, &tag, 1);
+}
+
+static void
+value_write_u32(valueWriter *w, uint32_t n)
+{
+  uint8_t bin[4];
+
+  bin[0] = n & 0xFF;
+  bin[1] = (n >> 8) & 0xFF;
+  bin[2] = (n >> 16) & 0xFF;
+  bin[3] = (n >> 24) & 0xFF;
+
+  value_write(w, bin, sizeof(bin));
+}
+
+static void
+value_write_u64(valueWriter *w, uint64_t n)
+{
+  value_write_u32(w, (uint32_t) (n & 0xFFFFFFFF));
+  value_write_u32(w, (uint32_t) (n >> 32));
+}
+
+static void
+value_write_bytes(valueWriter *w, char tag, const char *ptr, size_t len)
+{
+  value_write_tag(w, tag);
+  value_write_u32(w, (uint32_t) len);
+  value_write(w, ptr, len);
+}
+
+static void
+value_dump(mrb_state *mrb, valueWriter *w, mrb_value value, int depth)
+{
+  mrb_value keys;
+  mrb_int i, len;
+  const char *name;
+  int ai;
+
+  if (depth > CONTEXT_VALUE_MAX_DEPTH)
+  {
+    value_write_tag(w, VALUE_NIL);
+    w->lost++;
+
+    return;
+  }
+
+  switch (mrb_type(value))
+  {
+    case MRB_TT_FALSE:
+      value_write_tag(w, mrb_nil_p(value) ? VALUE_NIL : VALUE_FALSE);
+      break;
+    case MRB_TT_TRUE:
+      value_write_tag(w, VALUE_TRUE);
+      break;
+    case MRB_TT_FIXNUM:
+      value_write_tag(w, VALUE_INT);
+      value_write_u64(w, (uint64_t) (int64_t) mrb_fixnum(value));
+      break;
+#ifndef MRB_WITHOUT_FLOAT
+    case MRB_TT_FLOAT:
+    {
+      double d = (double) mrb_float(value);
+      uint64_t n;
+
+      memcpy(&n, &d, sizeof(n));
+      value_write_tag(w, VALUE_FLOAT);
+      value_write_u64(w, n);
+      break;
+    }
+#endif /* #ifndef MRB_WITHOUT_FLOAT */
+    case MRB_TT_STRING:
+      value_write_bytes(w, VALUE_STRING, RSTRING_PTR(value), RSTRING_LEN(value));
+      break;
+    case MRB_TT_SYMBOL:
+      name = mrb_sym2name_len(mrb, mrb_symbol(value), &len);
+      value_write_bytes(w, VALUE_SYMBOL, name, len);
+      break;
+    case MRB_TT_ARRAY:
+      len = RARRAY_LEN(value);
+      value_write_tag(w, VALUE_ARRAY);
+      value_write_u32(w, (uint32_t) len);
+      for (i = 0; i < len; i++)
+      {
+        value_dump(mrb, w, mrb_ary_ref(mrb, value, i), depth + 1);
+      }
+      break;
+    case MRB_TT_HASH:
+      ai = mrb_gc_arena_save(mrb);
+      keys = mrb_hash_keys(mrb, value);
+      len = RARRAY_LEN(keys);
+      value_write_tag(w, VALUE_HASH);
+      value_write_u32(w, (uint32_t) len);
+      for (i = 0; i < len; i++)
+      {
+        value_dump(mrb, w, RARRAY_PTR(keys)[i], depth + 1);
+        value_dump(mrb, w, mrb_hash_get(mrb, value, RARRAY_PTR(keys)[i]), depth + 1);
+      }
+      mrb_gc_arena_restore(mrb, ai);
+      break;
+    default:
+      value_write_tag(w, VALUE_NIL);
+      w->lost++;
+      break;
+  }
+}
+
+static const uint8_t *
+value_read(valueReader *r, size_t len)
+{
+  const uint8_t *ptr;
+
+  if (r->failed || len > r->len - r->pos)
+  {
+    r->failed = 1;
+
+    return NULL;
+  }
+
+  ptr = r->ptr + r->pos;
+
+  r->pos += len;
+
+  return ptr;
+}
+
+static uint32_t
+value_read_u32(valueReader *r)
+{
+  const uint8_t *bin = value_read(r, 4);
+
+  if (bin == NULL) return 0;
+
+  return (uint32_t) bin[0] | (uint32_t) bin[1] << 8 | (uint32_t) bin[2] << 16 | (uint32_t) bin[3] << 24;
+}
+
+static uint64_t
+value_read_u64(valueReader *r)
+{
+  uint64_t low = value_read_u32(r);
+
+  return low | (uint64_t) value_read_u32(r) << 32;
+}
+
+static mrb_value
+value_load(mrb_state *mrb, valueReader *r, int depth)
+{
+  const uint8_t *tag, *ptr;
+  mrb_value value, key;
+  uint32_t i, count;
+  int64_t n;
+  int ai;
+
+  tag = value_read(r, 1);
+
+  if (tag == NULL || depth > CONTEXT_VALUE_MAX_DEPTH)
+  {
+    r->failed = 1;
+
+    return mrb_nil_value();
+  }
+
+  switch (*tag)
+  {
+    case VALUE_NIL:
+      return mrb_nil_value();
+    case VALUE_TRUE:
+      return mrb_true_value();
+    case VALUE_FALSE:
+      return mrb_false_value();
+    case VALUE_INT:
+      n = (int64_t) value_read_u64(r);
+#ifndef MRB_WITHOUT_FLOAT
+      if (n > MRB_INT_MAX || n < MRB_INT_MIN) return mrb_float_value(mrb, (mrb_float) n);
+#endif /* #ifndef MRB_WITHOUT_FLOAT */
+      return mrb_fixnum_value((mrb_int) n);
+#ifndef MRB_WITHOUT_FLOAT
+    case VALUE_FLOAT:
+    {
+      uint64_t bits = value_read_u64(r);
+      double d;
+
+      memcpy(&d, &bits, sizeof(d));
+
+      return mrb_float_value(mrb, (mrb_float) d);
+    }
+#endif /* #ifndef MRB_WITHOUT_FLOAT */
+    case VALUE_STRING:
+    case VALUE_SYMBOL:
+      count = value_read_u32(r);
+      ptr = value_read(r, count);
+      if (ptr == NULL) return mrb_nil_value();
+      if (*tag == VALUE_SYMBOL) return mrb_symbol_value(mrb_intern(mrb, (const char *) ptr, count));
+      return mrb_str_new(mrb, (const char *) ptr, count);
+    case VALUE_ARRAY:
+      count = value_read_u32(r);
+      if (count > r->len - r->pos) break; /* at least a tag each */
+      value = mrb_ary_new_capa(mrb, count);
+      ai = mrb_gc_arena_save(mrb);
+      for (i = 0; i < count && !r->failed; i++)
+      {
+        mrb_ary_push(mrb, value, value_load(mrb, r, depth + 1));
+        mrb_gc_arena_restore(mrb, ai);
+      }
+      return value;
+    case VALUE_HASH:
+      count = value_read_u32(r);
+      if (count > (r->len - r->pos) / 2) break;
+      value = mrb_hash_new_capa(mrb, count);
+      ai = mrb_gc_arena_save(mrb);
+      for (i = 0; i < count && !r->failed; i++)
+      {
+        key = value_load(mrb, r, depth + 1);
+        mrb_hash_set(mrb, value, key, value_load(mrb, r, depth + 1));
+        mrb_gc_arena_restore(mrb, ai);
+      }
+      return value;
+    default:
+      break;
+  }
+
+  r->failed = 1;
+
+  return mrb_nil_value();
+}
+
+/**************************/
+/* Externalized functions */
+/**************************/
+
+static mrb_value
+mrb_context_value_s_dump(mrb_state *mrb, mrb_value self)
+{
+  mrb_value value, str;
+  char *buf = NULL;
+  size_t len = 0;
+  int lost;
+
+  mrb_get_args(mrb, "o", &value);
+
+  lost = context_value_dump(mrb, value, &buf, &len);
+
+  if (lost != 0)
+  {
+    free(buf);
+
+    if (lost < 0) mrb_raise(mrb, E_RUNTIME_ERROR, "could not allocate value buffer");
+
+    mrb_raise(mrb, E_TYPE_ERROR, "value is not transferable");
+  }
+
+  str = mrb_str_new(mrb, buf, len);
+
+  free(buf);
+
+  return str;
+}
+
+static mrb_value
+mrb_context_value_s_load(mrb_state *mrb, mrb_value self)
+{
+  mrb_value buf, value;
+
+  mrb_get_args(mrb, "S", &buf);
+
+  value = context_value_load(mrb, RSTRING_PTR(buf), RSTRING_LEN(buf));
+
+  if (mrb_undef_p(value))
+  {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "malformed value buffer");
+  }
+
+  return value;
+}
+
+/********************/
+/* Public functions */
+/********************/
+
+/**
+ * @brief Tells if a value (not its contents) has an exact encoding.
+ */
+int
+context_value_transferable(mrb_value value)
+{
+  switch (mrb_type(value))
+  {
+    case MRB_TT_FALSE:
+    case MRB_TT_TRUE:
+    case MRB_TT_FIXNUM:
+#ifndef MRB_WITHOUT_FLOAT
+    case MRB_TT_FLOAT:
+#endif /* #ifndef MRB_WITHOUT_FLOAT */
+    case MRB_TT_STRING:
+    case MRB_TT_SYMBOL:
+    case MRB_TT_ARRAY:
+    case MRB_TT_HASH:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * @brief Encodes a value.
+ *
+ * @param mrb state owning the value
+ * @param value given value
+ * @param buf encoded value (allocated, to be released with free())
+ * @param len encoded value length
+ *
+ * @return number of values encoded as nil for not being transferable, or -1
+ * when out of memory
+ */
+int
+context_value_dump(mrb_state *mrb, mrb_value value, char **buf, size_t *len)
+{
+  valueWriter w = { NULL, 0, 0, 0, 0 };
+
+  value_dump(mrb, &w, value, 0);
+
+  if (w.failed)
+  {
+    free(w.ptr);
+
+    *buf = NULL;
+    *len = 0;
+
+    return -1;
+  }
+
+  *buf = w.ptr;
+  *len = w.len;
+
+  return w.lost;
+}
+
+/**
+ * @brief Decodes a value.
+ *
+ * @param mrb state to create the value in
+ * @param buf encoded value
+ * @param len encoded value length
+ *
+ * @return decoded value or undef, when malformed
+ */
+mrb_value
+context_value_load(mrb_state *mrb, const char *buf, size_t len)
+{
+  valueReader r = { (const uint8_t *) buf, len, 0, 0 };
+  mrb_value value;
+
+  value = value_load(mrb, &r, 0);
+
+  if (r.failed || r.pos != r.len) return mrb_undef_value();
+
+  return value;
+}
+
+extern void
+mrb_context_value_init(mrb_state *mrb)
+{
+  struct RClass *context;
+  struct RClass *value;
+
+  TRACE_FUNCTION();
+
+  context = mrb_define_class(mrb, "Context", mrb->object_class);
+
+  value   = mrb_define_module_under(mrb, context, "Value");
+
+  mrb_define_class_method(mrb , value , "dump" , mrb_context_value_s_dump , MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb , value , "load" , mrb_context_value_s_load , MRB_ARGS_REQ(1));
+
+  TRACE("return");
+}
@@ -10,8 +10,10 @@
 
 #include <inttypes.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "mruby.h"
 #include "mruby/array.h"
@@ -20,6 +22,10 @@
 #include "mruby/error.h"
 #include "mruby/ext/context.h"
 #include "mruby/ext/context_log.h"
+#include "mruby/ext/context_value.h"
+#include "mruby/hash.h"
+#include "mruby/irep.h"
+#include "mruby/proc.h"
 #include "mruby/string.h"
 #include "mruby/variable.h"
 
@@ -29,16 +35,95 @@
 
 #define DONE mrb_gc_arena_restore(mrb, 0);
 
+#ifndef CONTEXT_EVAL_CACHE_SIZE
+#define CONTEXT_EVAL_CACHE_SIZE 16 /* compiled snippets kept per instance */
+#endif /* #ifndef CONTEXT_EVAL_CACHE_SIZE */
+
+#define CONTEXT_APPLICATION_SIZE 256 /* application name, NUL included */
+
+#define CONTEXT_REGISTRY_SIZE 16 /* initial registry buckets (grows) */
+
+#define LATENCY_BUCKETS 32 /* power-of-two microsecond buckets */
+#define LATENCY_ACQUIRE 0  /* mrb_alloc_instance (lookup or creation) */
+#define LATENCY_COMPILE 1  /* cache lookup + parse/codegen, or RITE load */
+#define LATENCY_EXECUTE 2  /* VM execution */
+#define LATENCY_PHASES 3
+
+#ifndef CONTEXT_MEMPROF_SLAB
+#define CONTEXT_MEMPROF_SLAB 1 /* small allocations from per-instance slabs */
+#endif /* #ifndef CONTEXT_MEMPROF_SLAB */
+
+#define MEMHEADER_SIZE (sizeof(struct memheader) - sizeof(((struct memheader *) 0)->obj))
+
+#ifndef CONTEXT_MEMORY_SOFT_LIMIT
+#define CONTEXT_MEMORY_SOFT_LIMIT 0 /* instance heap bytes triggering GC (0: none) */
+#endif /* #ifndef CONTEXT_MEMORY_SOFT_LIMIT */
+
+#ifndef CONTEXT_MEMORY_HARD_LIMIT
+#define CONTEXT_MEMORY_HARD_LIMIT 0 /* instance heap bytes failing allocations (0: none) */
+#endif /* #ifndef CONTEXT_MEMORY_HARD_LIMIT */
+
+/* Both limits apply to the live heap (requested sizes, headers included).
+ * Slab chunks kept for reuse once their blocks are freed are not counted:
+ * an instance may hold up to Vm.stats[:slab_chunks] * CONTEXT_SLAB_CHUNK_SIZE
+ * bytes on top of it (see context_slab.c). */
+
+#define MEMPROF_HISTOGRAM 24 /* power-of-two size buckets (1 B up to 8 MB) */
+
+/* Allocator counters are shared with other threads reading stats */
+#define MEMPROF_ADD(field, n) __sync_add_and_fetch(&(field), (n))
+#define MEMPROF_READ(field) __sync_add_and_fetch(&(field), 0)
+#define MEMPROF_WRITE(field, n) __sync_lock_test_and_set(&(field), (n))
+
 /********************/
 /* Type definitions */
 /********************/
 
+typedef struct evalCacheEntry
+{
+  char *code;
+  size_t len;
+  uint32_t hash;
+  int slen; /* context locals when compiled (procs depend on them) */
+  unsigned long used;
+  struct RProc *proc;
+} evalCacheEntry;
+
+typedef struct evalCache
+{
+  evalCacheEntry entries[CONTEXT_EVAL_CACHE_SIZE];
+  unsigned long tick;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+} evalCache;
+
+typedef struct latencyHistogram
+{
+  unsigned int buckets[LATENCY_BUCKETS]; /* [i]: 2^i <= usec < 2^(i+1) */
+  unsigned int count;
+  unsigned long long max;
+  unsigned long long last;
+} latencyHistogram;
+
 typedef struct instance
 {
-  char application[256];
+  char application[CONTEXT_APPLICATION_SIZE];
   mrbc_context *context;
   mrb_state *mrb;
   int outdated;
+  int refs; /* registry + in-flight callers */
+  pthread_mutex_t lock; /* held while evaluating (recursive, nested mrb_eval) */
+  uint32_t hash;
+  struct instance *next;
+  evalCache cache;
+  unsigned long long compile_usec; /* last source compilation (cache miss) */
+  size_t compile_irep_size;
+  unsigned long long load_usec; /* last RITE binary load */
+  size_t load_irep_size;
+  unsigned long eval_cnt;
+  unsigned long long eval_usec; /* total, compilation included */
+  latencyHistogram latency[LATENCY_PHASES];
 } instance;
 
 /* typedef */ struct memheader
@@ -61,6 +146,12 @@ typedef struct instance
   unsigned long long total_size;
   unsigned int current_objcnt;
   unsigned long long current_size;
+  unsigned long long peak_size; /* current_size high-water mark */
+  unsigned int size_histogram[MEMPROF_HISTOGRAM]; /* [i]: 2^i <= size < 2^(i+1) */
+  unsigned long long soft_limit; /* 0: unlimited */
+  unsigned long long hard_limit; /* 0: unlimited */
+  unsigned int rejected_cnt; /* allocations failed by hard_limit */
+  struct contextSlab *slab; /* NULL when every block comes from libc */
 } /* memprof_userdata */;
 
 /********************/
@@ -69,9 +160,25 @@ typedef struct instance
 
 /* Static */
 
-static pthread_mutex_t context_mutex;
+static pthread_rwlock_t context_lock;
+
+static unsigned long long memory_soft_limit = CONTEXT_MEMORY_SOFT_LIMIT;
 
-static struct instance *instances[20];
+static unsigned long long memory_hard_limit = CONTEXT_MEMORY_HARD_LIMIT;
+
+static unsigned long long slow_eval_usec = 0; /* 0: slow evals aren't logged */
+
+/**
+ * @brief Instance registry, hashed by application name and chained. Every
+ * instance in here holds one reference of its own; callers take another while
+ * using it (@link mrb_alloc_instance @endlink, @link instance_release
+ * @endlink).
+ */
+static struct instance **registry = NULL;
+
+static size_t registry_count = 0;
+
+static size_t registry_size = 0;
 
 /***********************/
 /* Function prototypes */
@@ -79,12 +186,135 @@ static struct instance *instances[20];
 
 extern void context_memprof_init(mrb_allocf *, void **);
 
+extern void context_memprof_final(void *);
+
+extern int context_slab_class(size_t size);
+
+extern struct contextSlab *context_slab_new(void);
+
+extern void *context_slab_alloc(struct contextSlab *slab, int class);
+
+extern void context_slab_free(struct contextSlab *slab, int class, void *ptr);
+
+extern void context_slab_destroy(struct contextSlab *slab);
+
+extern unsigned int context_slab_chunks(const struct contextSlab *slab);
+
+extern void mrb_context_eval_pool_init(mrb_state *mrb);
+
+extern void mrb_context_value_init(mrb_state *mrb);
+
+extern void mrb_thread_pub_sub_init(mrb_state *mrb);
+
 extern void mrb_thread_scheduler_init(mrb_state *mrb);
 
 /*********************/
 /* Private functions */
 /*********************/
 
+static int
+context_memprof_class(struct memprof_userdata *ud, size_t len)
+{
+  return (ud->slab != NULL) ? context_slab_class(len + MEMHEADER_SIZE) : -1;
+}
+
+static void
+context_memprof_release(struct memprof_userdata *ud, struct memheader *mptr)
+{
+  int class = context_memprof_class(ud, mptr->len);
+
+  mptr->len = SIZE_MAX;
+
+  if (class >= 0)
+    context_slab_free(ud->slab, class, mptr);
+  else
+    free(mptr);
+}
+
+/**
+ * @brief Resizes a block, moving it between the slab (small sizes) and libc
+ * (large ones) when its size class changes.
+ */
+static struct memheader *
+context_memprof_resize(struct memprof_userdata *ud, struct memheader *mptr, size_t size)
+{
+  int oldclass = (mptr != NULL) ? context_memprof_class(ud, mptr->len) : -1;
+  int newclass = context_memprof_class(ud, size);
+  struct memheader *block;
+
+  if (oldclass < 0 && newclass < 0) {
+    return realloc(mptr, size + MEMHEADER_SIZE);
+  }
+
+  if (oldclass == newclass) {
+    return mptr;
+  }
+
+  if (newclass >= 0)
+    block = context_slab_alloc(ud->slab, newclass);
+  else
+    block = malloc(size + MEMHEADER_SIZE);
+
+  if (block != NULL && mptr != NULL) {
+    memcpy(&block->obj, &mptr->obj, (mptr->len < size) ? mptr->len : size);
+    context_memprof_release(ud, mptr);
+  }
+
+  return block;
+}
+
+/**
+ * @brief Accounts a size change of the live heap, raising the high-water mark
+ * if needed.
+ */
+static void
+context_memprof_grow(struct memprof_userdata *ud, size_t oldsize, size_t size)
+{
+  unsigned long long current, peak;
+  int bucket = 0;
+
+  current = MEMPROF_ADD(ud->current_size, (unsigned long long) size - oldsize);
+
+  peak = ud->peak_size;
+
+  while (current > peak && !__sync_bool_compare_and_swap(&ud->peak_size, peak, current))
+  {
+    peak = ud->peak_size;
+  }
+
+  while (bucket < MEMPROF_HISTOGRAM - 1 && (size >> (bucket + 1)) != 0) bucket++;
+
+  MEMPROF_ADD(ud->size_histogram[bucket], 1);
+}
+
+/**
+ * @brief Checks a heap growth against the state budget. Over the soft limit,
+ * the next object allocation runs an incremental GC step (the allocator
+ * itself is no safe point for collecting); over the hard limit, allocation
+ * fails, so mruby runs a full GC and raises NoMemoryError if still short.
+ *
+ * @return 1 if the growth is allowed or 0, otherwise
+ */
+static int
+context_memprof_budget(mrb_state *mrb, struct memprof_userdata *ud, size_t growth)
+{
+  unsigned long long next = MEMPROF_READ(ud->current_size) + growth;
+
+  unsigned long long soft = MEMPROF_READ(ud->soft_limit);
+  unsigned long long hard = MEMPROF_READ(ud->hard_limit);
+
+  if (hard && next > hard) {
+    MEMPROF_ADD(ud->rejected_cnt, 1);
+    return 0;
+  }
+
+  if (soft && next > soft && mrb != NULL) {
+    mrb->gc.threshold = 0;
+  }
+
+  return 1;
+}
+
 static void *
 context_memprof_allocf(struct mrb_state *mrb, void *ptr, size_t size, void *ud0)
 {
@@ -100,132 +330,957 @@ context_memprof_allocf(struct mrb_state *mrb, void *ptr, size_t size, void *ud0)
 
   if (size == 0) {
     /* free(ptr) */
-    ud->free_cnt++;
+    MEMPROF_ADD(ud->free_cnt, 1);
     if (mptr != NULL) {
-      ud->current_objcnt--;
-      ud->current_size -= mptr->len;
-      mptr->len = SIZE_MAX;
-      free(mptr);
+      MEMPROF_ADD(ud->current_objcnt, -1);
+      MEMPROF_ADD(ud->current_size, -(unsigned long long) mptr->len);
+      context_memprof_release(ud, mptr);
     } else {
-      ud->freezero_cnt++;
+      MEMPROF_ADD(ud->freezero_cnt, 1);
     }
     return NULL;
   }
   else {
     /* Check memory leak size */
     if (size >= 1000000) return NULL;
+    if (mptr != NULL) oldsize = mptr->len;
+    /* Check instance budget */
+    if (size > oldsize && !context_memprof_budget(mrb, ud, size - oldsize)) return NULL;
     /* malloc(size) or realloc(ptr, size) */
     if (ptr == NULL) {
-      ud->malloc_cnt++;
+      MEMPROF_ADD(ud->malloc_cnt, 1);
     } else {
-      ud->realloc_cnt++;
-      oldsize = mptr->len;
+      MEMPROF_ADD(ud->realloc_cnt, 1);
     }
-    mptr = realloc(mptr, size + sizeof(*mptr) - sizeof(mptr->obj));
+    mptr = context_memprof_resize(ud, mptr, size);
     if (mptr == NULL) {
       return NULL;
     }
     mptr->len = size;
     if (ptr == NULL) {
-      ud->current_objcnt++;
-    } else {
-      ud->current_size -= oldsize;
+      MEMPROF_ADD(ud->current_objcnt, 1);
     }
-    ud->current_size += size;
-    ud->total_size += size;
+    context_memprof_grow(ud, oldsize, size);
+    MEMPROF_ADD(ud->total_size, size);
     return (void *) &mptr->obj;
   }
 }
 
-static instance *
-mrb_alloc_instance(char *application_name, int application_size, mrb_state *mrb)
+/**
+ * @brief Monotonic clock in microseconds, for timing evaluation phases.
+ */
+static unsigned long long
+context_clock_usec(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (unsigned long long) now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/**
+ * @brief Records a phase duration. Written by the evaluating thread, read by
+ * any other one through Vm.instance(s).
+ */
+static void
+latency_record(latencyHistogram *histogram, unsigned long long usec)
+{
+  unsigned long long max = histogram->max;
+  int bucket = 0;
+
+  while (bucket < LATENCY_BUCKETS - 1 && (usec >> (bucket + 1)) != 0) bucket++;
+
+  __sync_add_and_fetch(&histogram->buckets[bucket], 1);
+  __sync_add_and_fetch(&histogram->count, 1);
+
+  while (usec > max && !__sync_bool_compare_and_swap(&histogram->max, max, usec))
+  {
+    max = histogram->max;
+  }
+
+  histogram->last = usec;
+}
+
+/**
+ * @brief Approximates a percentile by the upper bound of the bucket holding
+ * it (never above the exact maximum).
+ */
+static unsigned long long
+latency_percentile(const latencyHistogram *histogram, int percentile)
+{
+  unsigned long long rank, seen = 0, bound;
+  int i;
+
+  if (histogram->count == 0) return 0;
+
+  rank = ((unsigned long long) histogram->count * percentile + 99) / 100;
+
+  for (i = 0; i < LATENCY_BUCKETS; i++)
+  {
+    seen += histogram->buckets[i];
+
+    if (seen >= rank) break;
+  }
+
+  bound = (i < LATENCY_BUCKETS - 1) ? (2ULL << i) - 1 : histogram->max;
+
+  return (bound < histogram->max) ? bound : histogram->max;
+}
+
+/**
+ * @brief Memory taken by an irep tree (instructions, pool, symbols and child
+ * ireps), comparable between compiled source and loaded RITE binaries.
+ */
+static size_t
+context_irep_size(const mrb_irep *irep)
+{
+  size_t size;
+  int i;
+
+  if (irep == NULL) return 0;
+
+  size = sizeof(*irep) + irep->ilen * sizeof(mrb_code) + irep->plen * sizeof(mrb_value) + irep->slen * sizeof(mrb_sym) + irep->rlen * sizeof(mrb_irep *);
+
+  for (i = 0; i < irep->rlen; i++)
+  {
+    size += context_irep_size(irep->reps[i]);
+  }
+
+  return size;
+}
+
+/**
+ * @brief FNV-1a hash, used as both the compiled-proc cache key and the
+ * instance registry index.
+ */
+static uint32_t
+context_hash(const char *code, size_t len)
+{
+  uint32_t hash = 2166136261u;
+
+  while (len--)
+  {
+    hash ^= (unsigned char) *code++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static evalCacheEntry *
+eval_cache_find(evalCache *cache, const char *code, size_t len, uint32_t hash)
+{
+  int i;
+  evalCacheEntry *entry;
+
+  for (i = 0; i < CONTEXT_EVAL_CACHE_SIZE; i++)
+  {
+    entry = &cache->entries[i];
+
+    if (entry->proc != NULL && entry->hash == hash && entry->len == len && memcmp(entry->code, code, len) == 0)
+    {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+static void
+eval_cache_drop(mrb_state *mrb, evalCacheEntry *entry)
+{
+  if (entry->proc != NULL && mrb != NULL)
+  {
+    mrb_gc_unregister(mrb, mrb_obj_value(entry->proc));
+  }
+
+  free(entry->code);
+
+  memset(entry, 0, sizeof(*entry));
+}
+
+/**
+ * @brief Searches the instance cache for an already compiled snippet. A proc
+ * is only reused while the context local variables are the same ones it was
+ * compiled against.
+ *
+ * @param current instance
+ * @param code snippet
+ * @param len snippet length
+ *
+ * @return cached proc or NULL, otherwise
+ */
+static struct RProc *
+eval_cache_lookup(instance *current, const char *code, size_t len)
+{
+  evalCache *cache = &current->cache;
+  evalCacheEntry *entry;
+
+  entry = eval_cache_find(cache, code, len, context_hash(code, len));
+
+  if (entry == NULL || entry->slen != current->context->slen)
+  {
+    cache->misses++;
+
+    return NULL;
+  }
+
+  entry->used = ++cache->tick;
+  cache->hits++;
+
+  return entry->proc;
+}
+
+/**
+ * @brief Keeps a compiled snippet in the instance cache, evicting the least
+ * recently used one when it is full.
+ *
+ * @param current instance
+ * @param code snippet
+ * @param len snippet length
+ * @param slen context locals the proc was compiled against
+ * @param proc compiled snippet
+ */
+static void
+eval_cache_store(instance *current, const char *code, size_t len, int slen, struct RProc *proc)
+{
+  int i;
+  uint32_t hash = context_hash(code, len);
+  evalCache *cache = &current->cache;
+  evalCacheEntry *entry;
+  char *copy;
+
+  copy = (char *) malloc(len + 1);
+
+  if (copy == NULL) return;
+
+  memcpy(copy, code, len);
+  copy[len] = 0;
+
+  entry = eval_cache_find(cache, code, len, hash); /* stale locals */
+
+  for (i = 0; entry == NULL && i < CONTEXT_EVAL_CACHE_SIZE; i++)
+  {
+    if (cache->entries[i].proc == NULL) entry = &cache->entries[i];
+  }
+
+  if (entry == NULL)
+  {
+    entry = &cache->entries[0];
+
+    for (i = 1; i < CONTEXT_EVAL_CACHE_SIZE; i++)
+    {
+      if (cache->entries[i].used < entry->used) entry = &cache->entries[i];
+    }
+
+    cache->evictions++;
+  }
+
+  eval_cache_drop(current->mrb, entry);
+
+  mrb_gc_register(current->mrb, mrb_obj_value(proc));
+
+  entry->code = copy;
+  entry->len = len;
+  entry->hash = hash;
+  entry->slen = slen;
+  entry->used = ++cache->tick;
+  entry->proc = proc;
+}
+
+static void
+eval_cache_clean(instance *current)
+{
+  int i;
+
+  for (i = 0; i < CONTEXT_EVAL_CACHE_SIZE; i++)
+  {
+    eval_cache_drop(NULL, &current->cache.entries[i]); /* mrb_close() takes
+                                                        * care of the procs */
+  }
+}
+
+/**
+ * @brief Searches the registry for a given application. Caller must hold
+ * @link context_lock @endlink.
+ */
+static instance *
+registry_find(const char *application, uint32_t hash)
+{
+  instance *current;
+
+  if (registry == NULL) return NULL;
+
+  current = registry[hash & (registry_size - 1)];
+
+  while (current != NULL)
+  {
+    if (current->hash == hash && strcmp(current->application, application) == 0)
+    {
+      return current;
+    }
+
+    current = current->next;
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Doubles the registry bucket count, rehashing every instance. Caller
+ * must hold @link context_lock @endlink for writing.
+ *
+ * @return 1 on success or 0, otherwise
+ */
+static int
+registry_grow(void)
+{
+  size_t i, size = (registry_size) ? registry_size * 2 : CONTEXT_REGISTRY_SIZE;
+  instance **buckets;
+  instance *current, *next;
+
+  buckets = (instance **) calloc(size, sizeof(instance *));
+
+  if (buckets == NULL) return 0;
+
+  for (i = 0; i < registry_size; i++)
+  {
+    current = registry[i];
+
+    while (current != NULL)
+    {
+      next = current->next;
+      current->next = buckets[current->hash & (size - 1)];
+      buckets[current->hash & (size - 1)] = current;
+      current = next;
+    }
+  }
+
+  free(registry);
+
+  registry = buckets;
+  registry_size = size;
+
+  return 1;
+}
+
+/**
+ * @brief Adds an instance to the registry. Caller must hold @link
+ * context_lock @endlink for writing.
+ */
+static void
+registry_insert(instance *current)
+{
+  instance **bucket;
+
+  if (registry_count + 1 > registry_size - registry_size / 4 && !registry_grow())
+  {
+    if (registry == NULL) abort(); /* keeps chaining when growing fails */
+  }
+
+  bucket = &registry[current->hash & (registry_size - 1)];
+
+  current->next = *bucket;
+  *bucket = current;
+
+  registry_count++;
+}
+
+/**
+ * @brief Unlinks an instance from the registry. Caller must hold @link
+ * context_lock @endlink for writing.
+ *
+ * @return 1 if the instance was registered or 0, otherwise
+ */
+static int
+registry_remove(instance *current)
+{
+  instance **link;
+
+  if (registry == NULL) return 0;
+
+  link = &registry[current->hash & (registry_size - 1)];
+
+  while (*link != NULL)
+  {
+    if (*link == current)
+    {
+      *link = current->next;
+      current->next = NULL;
+      registry_count--;
+
+      return 1;
+    }
+
+    link = &(*link)->next;
+  }
+
+  return 0;
+}
+
+static void
+mrb_free_instance(instance *current)
+{
+  void *ud = current->mrb->allocf_ud;
+
+  eval_cache_clean(current);
+  mrbc_context_free(current->mrb, current->context);
+  mrb_close(current->mrb);
+  context_memprof_final(ud); /* whole slabs at once */
+  pthread_mutex_destroy(&current->lock);
+  free(current);
+}
+
+static void
+instance_retain(instance *current)
+{
+  __sync_add_and_fetch(&current->refs, 1);
+}
+
+/**
+ * @brief Drops a reference, freeing the instance along with the last one. An
+ * instance being evaluated by some thread is never freed under its feet.
+ */
+static void
+instance_release(instance *current)
+{
+  if (current != NULL && __sync_sub_and_fetch(&current->refs, 1) == 0)
+  {
+    mrb_free_instance(current);
+  }
+}
+
+/**
+ * @brief Takes the evaluation lock of an instance. Every thread evaluating
+ * on an instance (mrb_eval callers, async workers, scheduler workers) holds
+ * it, so a state is never run by two threads at once.
+ */
+static void
+instance_lock(instance *current)
+{
+  pthread_mutex_lock(&current->lock);
+}
+
+static void
+instance_unlock(instance *current)
+{
+  pthread_mutex_unlock(&current->lock);
+}
+
+/**
+ * @brief Unregisters an instance (if still registered), dropping the
+ * registry reference.
+ */
+static void
+instance_retire(instance *current)
+{
+  int removed;
+
+  pthread_rwlock_wrlock(&context_lock);
+
+  removed = registry_remove(current);
+
+  pthread_rwlock_unlock(&context_lock);
+
+  if (removed) instance_release(current);
+}
+
+/**
+ * @brief Retains the instance of a given application, if running.
+ *
+ * @param application application name
+ *
+ * @return retained instance or NULL, otherwise
+ */
+static instance *
+instance_get(const char *application)
+{
+  instance *current;
+
+  pthread_rwlock_rdlock(&context_lock);
+
+  current = registry_find(application, context_hash(application, strlen(application)));
+
+  if (current != NULL) instance_retain(current);
+
+  pthread_rwlock_unlock(&context_lock);
+
+  return current;
+}
+
+/**
+ * @brief Finds or creates the instance of a given application. The returned
+ * instance is retained and must be given back with @link instance_release
+ * @endlink.
+ *
+ * @param application_name application name
+ * @param application_size application name length
+ * @param mrb calling state, NULL for native callers
+ *
+ * @return retained instance or NULL, when a native caller's instance can't be
+ * opened (a calling state gets a RuntimeError instead) or its name is too long
+ * (an ArgumentError)
+ */
+static instance *
+mrb_alloc_instance(char *application_name, int application_size, mrb_state *mrb)
+{
+  void *ud;
+  instance *current;
+  instance *existing;
+  mrb_allocf allocf;
+  pthread_mutexattr_t attr;
+  uint32_t hash;
+  unsigned long long start = context_clock_usec();
+
+  TRACE_FUNCTION();
+
+  /* Hashed and compared up to the first NUL, as lookups by C string do */
+  application_size = (application_size > 0) ? strnlen(application_name, application_size) : 0;
+
+  /* Never stored truncated: a name that doesn't fit would never be found */
+  if (application_size >= CONTEXT_APPLICATION_SIZE)
+  {
+    if (mrb != NULL) mrb_raisef(mrb, E_ARGUMENT_ERROR, "application name too long (up to %S bytes)", mrb_fixnum_value(CONTEXT_APPLICATION_SIZE - 1));
+
+    TRACE("return");
+
+    return NULL;
+  }
+
+  hash = context_hash(application_name, application_size);
+
+  pthread_rwlock_rdlock(&context_lock);
+
+  current = registry_find(application_name, hash);
+
+  if (current != NULL) instance_retain(current);
+
+  pthread_rwlock_unlock(&context_lock);
+
+  if (current != NULL)
+  {
+    latency_record(&current->latency[LATENCY_ACQUIRE], context_clock_usec() - start);
+
+    TRACE("return");
+
+    return current;
+  }
+
+  /* Opening a new state is expensive, so it happens without the lock; a
+   * concurrent creation of the same application wins the race below */
+
+  current = (instance *) calloc(1, sizeof(instance));
+
+  if (current == NULL)
+  {
+    abort();
+  }
+
+  context_memprof_init(&allocf, &ud);
+  current->mrb = mrb_open_allocf(allocf, ud);
+
+  if (current->mrb == NULL)
+  {
+    context_memprof_final(ud);
+    free(current);
+
+    if (mrb != NULL) mrb_raise(mrb, E_RUNTIME_ERROR, "could not open application instance");
+
+    TRACE("return");
+
+    return NULL;
+  }
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&current->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  /* Budget applies once the state is open, so opening never fails on it */
+  ((struct memprof_userdata *) ud)->soft_limit = memory_soft_limit;
+  ((struct memprof_userdata *) ud)->hard_limit = memory_hard_limit;
+
+  current->context = mrbc_context_new(current->mrb);
+  current->context->capture_errors = TRUE;
+  current->context->no_optimize = TRUE;
+  current->outdated = FALSE;
+  current->refs = 2; /* registry + caller */
+  current->hash = hash;
+  memcpy(current->application, application_name, application_size);
+
+  pthread_rwlock_wrlock(&context_lock);
+
+  existing = registry_find(current->application, hash);
+
+  if (existing != NULL)
+  {
+    instance_retain(existing);
+  }
+  else
+  {
+    registry_insert(current);
+  }
+
+  pthread_rwlock_unlock(&context_lock);
+
+  if (existing != NULL)
+  {
+    mrb_free_instance(current);
+
+    current = existing;
+  }
+
+  latency_record(&current->latency[LATENCY_ACQUIRE], context_clock_usec() - start);
+
+  TRACE("return");
+
+  return current;
+}
+
+
+/**
+ * @brief Accounts an evaluation (read by other threads through Vm.instances).
+ */
+static void
+context_account(instance *current, unsigned long long start, const char *code, size_t len)
+{
+  unsigned long long usec = context_clock_usec() - start;
+
+  __sync_add_and_fetch(&current->eval_cnt, 1);
+  __sync_add_and_fetch(&current->eval_usec, usec);
+
+  usec += current->latency[LATENCY_ACQUIRE].last;
+
+  if (slow_eval_usec && usec >= slow_eval_usec)
+  {
+    ContextLogFile("\nslow mrb_eval [%s] %llu us (acquire %llu, compile %llu, execute %llu): %.*s",
+        current->application, usec, current->latency[LATENCY_ACQUIRE].last,
+        current->latency[LATENCY_COMPILE].last, current->latency[LATENCY_EXECUTE].last,
+        (code) ? (int) ((len < 256) ? len : 256) : 13, (code) ? code : "<RITE binary>");
+  }
+}
+
+/**
+ * @brief Runs a full GC on a state left over its soft memory limit.
+ */
+static void
+context_memprof_collect(mrb_state *mrb)
+{
+  struct memprof_userdata *ud = mrb->allocf_ud;
+  unsigned long long soft = MEMPROF_READ(ud->soft_limit);
+
+  if (soft && MEMPROF_READ(ud->current_size) > soft) {
+    mrb_full_gc(mrb);
+  }
+}
+
+/**
+ * @brief Runs a compiled proc at the top level of a given instance, taking the
+ * same steps mrb_load_exec() takes after code generation.
+ */
+static mrb_value
+context_run(instance *current, struct RProc *proc)
+{
+  mrb_state *imrb = current->mrb;
+  mrbc_context *cxt = current->context;
+  unsigned long long start;
+  unsigned int keep = 0;
+  mrb_value ret;
+
+  if (cxt->keep_lv)
+    keep = cxt->slen + 1; /* binaries as well, so locals aren't cleared */
+  else
+    cxt->keep_lv = TRUE;
+
+  MRB_PROC_SET_TARGET_CLASS(proc, imrb->object_class);
+  if (imrb->c->ci) imrb->c->ci->target_class = imrb->object_class;
+
+  start = context_clock_usec();
+
+  ret = mrb_top_run(imrb, proc, mrb_top_self(imrb), keep);
+
+  latency_record(&current->latency[LATENCY_EXECUTE], context_clock_usec() - start);
+
+  context_memprof_collect(imrb);
+
+  if (imrb->exc) return mrb_nil_value();
+
+  return ret;
+}
+
+/**
+ * @brief Evaluates a snippet inside of a given instance. Compiled snippets are
+ * cached, so repeated calls skip the parser and code generator altogether.
+ *
+ * @param current instance
+ * @param code snippet
+ * @param len snippet length
+ *
+ * @return evaluation result, owned by the instance
+ */
+static mrb_value
+context_eval(instance *current, const char *code, size_t len)
+{
+  mrbc_context *cxt = current->context;
+  struct RProc *proc;
+  unsigned long long start, compile;
+  int slen;
+  mrb_value ret;
+
+  start = context_clock_usec();
+
+  proc = eval_cache_lookup(current, code, len);
+
+  if (proc == NULL)
+  {
+    slen = cxt->slen;
+    compile = context_clock_usec();
+
+    cxt->no_exec = TRUE;
+    ret = mrb_load_nstring_cxt(current->mrb, code, len, cxt);
+    cxt->no_exec = FALSE;
+
+    if (mrb_type(ret) != MRB_TT_PROC) /* parser/codegen error */
+    {
+      latency_record(&current->latency[LATENCY_COMPILE], context_clock_usec() - start);
+
+      context_account(current, start, code, len);
+
+      return ret;
+    }
+
+    proc = (struct RProc *) mrb_ptr(ret);
+
+    current->compile_usec = context_clock_usec() - compile;
+    current->compile_irep_size = context_irep_size(proc->body.irep);
+
+    eval_cache_store(current, code, len, slen, proc);
+  }
+
+  latency_record(&current->latency[LATENCY_COMPILE], context_clock_usec() - start);
+
+  ret = context_run(current, proc);
+
+  context_account(current, start, code, len);
+
+  return ret;
+}
+
+/**
+ * @brief Evaluates a precompiled RITE binary (mrbc output) inside of a given
+ * instance, skipping the parser and code generator.
+ *
+ * @param current instance
+ * @param bin RITE binary, already checked by @link context_irep_check
+ * @endlink
+ *
+ * @return evaluation result, owned by the instance
+ */
+static mrb_value
+context_eval_irep(instance *current, const uint8_t *bin)
+{
+  mrb_state *imrb = current->mrb;
+  struct RProc *proc;
+  mrb_irep *irep;
+  unsigned long long start;
+  mrb_value ret;
+
+  start = context_clock_usec();
+
+  irep = mrb_read_irep(imrb, bin);
+
+  if (irep == NULL)
+  {
+    latency_record(&current->latency[LATENCY_COMPILE], context_clock_usec() - start);
+
+    context_account(current, start, NULL, 0);
+
+    return mrb_nil_value();
+  }
+
+  proc = mrb_proc_new(imrb, irep);
+  mrb_irep_decref(imrb, irep);
+
+  current->load_usec = context_clock_usec() - start;
+  current->load_irep_size = context_irep_size(irep);
+
+  latency_record(&current->latency[LATENCY_COMPILE], current->load_usec);
+
+  ret = context_run(current, proc);
+
+  context_account(current, start, NULL, 0);
+
+  return ret;
+}
+
+/**
+ * @brief Checks a RITE binary header against the buffer holding it, since
+ * mrb_read_irep() trusts the size the header claims.
+ *
+ * @return 1 if valid or 0, otherwise
+ */
+static int
+context_irep_check(const uint8_t *bin, size_t len)
+{
+  const struct rite_binary_header *header = (const struct rite_binary_header *) bin;
+
+  if (len < sizeof(*header)) return 0;
+
+  if (memcmp(header->binary_ident, RITE_BINARY_IDENT, sizeof(header->binary_ident)) != 0) return 0;
+
+  return bin_to_uint32(header->binary_size) <= len;
+}
+
+/**
+ * @brief Retains the instance of a given application, restarting it through
+ * `mrb_start` (from the calling state) when outdated.
+ */
+static instance *
+mrb_start_instance(mrb_state *mrb, mrb_value self, mrb_value application)
+{
+  instance *current;
+
+  current = mrb_alloc_instance(RSTRING_PTR(application), RSTRING_LEN(application), mrb);
+
+  if (current->outdated) {
+    instance_retire(current);
+    instance_release(current);
+    mrb_funcall(mrb, self, "mrb_start", 1, application);
+    current = mrb_alloc_instance(RSTRING_PTR(application), RSTRING_LEN(application), mrb);
+  }
+
+  return current;
+}
+
+/**
+ * @brief Hands an instance result over to the calling state. Called with the
+ * instance locked, which it unlocks: the result is encoded while the instance
+ * can't change and decoded once unlocked, since decoding allocates on the
+ * calling state and may raise. Objects that can't cross states come back as
+ * true, so callers testing for success still see a truthy value.
+ */
+static mrb_value
+mrb_instance_result(mrb_state *mrb, instance *current, mrb_value ret)
+{
+  /* 2020-11-23: if starting new mruby contexts isn't natively an asynchronous
+   * operation, it may be a problem to use it as if it was. It's something to
+   * bear in mind along the way. */
+
+  mrb_value value;
+  char *buf;
+  size_t len;
+
+  if (mrb_undef_p(ret))
+    ret = mrb_nil_value();
+  else if (!context_value_transferable(ret))
+    ret = mrb_true_value();
+
+  if (context_value_dump(current->mrb, ret, &buf, &len) < 0) buf = NULL;
+
+  instance_unlock(current);
+
+  if (buf == NULL) return mrb_nil_value();
+
+  value = context_value_load(mrb, buf, len);
+
+  free(buf);
+
+  return mrb_undef_p(value) ? mrb_nil_value() : value;
+}
+
+static mrb_value
+mrb_mrb_eval(mrb_state *mrb, mrb_value self)
 {
-  int i = 0;
-  void *ud;
+  mrb_value code, ret, mrb_ret, application;
   instance *current;
-  mrb_allocf allocf;
-  int instance_free_spot = -1;
 
-  TRACE_FUNCTION();
+  mrb_ret = mrb_nil_value();
+  mrb_get_args(mrb, "S|S", &code, &application);
 
-  pthread_mutex_lock(&context_mutex); /* 2020-11-23: poor protection (shared
-                                       * mem. address is externalized in return
-                                       * statements) */
+  current = mrb_alloc_instance(RSTRING_PTR(application), RSTRING_LEN(application), mrb);
+  if (current->outdated && strcmp(RSTRING_PTR(code), "Context.start") >= 0) {
+    instance_lock(current);
+    ret = mrb_true_value();
+  } else {
+    if (current->outdated) {
+      instance_release(current);
+      current = mrb_start_instance(mrb, self, application);
+    }
+    instance_lock(current);
+    ret = context_eval(current, RSTRING_PTR(code), RSTRING_LEN(code));
+  }
 
-  while (i < 20) {
-    if (instances[i] != NULL && strcmp(instances[i]->application, application_name) == 0) {
-      TRACE("return");
+  mrb_ret = mrb_instance_result(mrb, current, ret);
 
-      pthread_mutex_unlock(&context_mutex);
+  instance_release(current);
 
-      return instances[i];
-    }
-    if (instance_free_spot == -1 && instances[i] == NULL) instance_free_spot = i;
-    i++;
-  }
+  return mrb_ret;
+}
 
-  current = (instance *) malloc(sizeof(instance));
+static mrb_value
+mrb_mrb_eval_irep(mrb_state *mrb, mrb_value self)
+{
+  mrb_value binary, application, mrb_ret;
+  instance *current;
 
-  context_memprof_init(&allocf, &ud);
-  current->mrb = mrb_open_allocf(allocf, ud);
+  mrb_get_args(mrb, "SS", &binary, &application);
 
-  current->context = mrbc_context_new(current->mrb);
-  current->context->capture_errors = TRUE;
-  current->context->no_optimize = TRUE;
-  current->outdated = FALSE;
-  memset(current->application, 0, 256);
-  strcpy(current->application, application_name);
+  if (!context_irep_check((const uint8_t *) RSTRING_PTR(binary), RSTRING_LEN(binary))) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid RITE binary");
+  }
 
-  instances[instance_free_spot] = current;
+  current = mrb_start_instance(mrb, self, application);
 
-  TRACE("return");
+  instance_lock(current);
 
-  pthread_mutex_unlock(&context_mutex);
+  mrb_ret = mrb_instance_result(mrb, current, context_eval_irep(current, (const uint8_t *) RSTRING_PTR(binary)));
 
-  return current;
-}
+  instance_release(current);
 
-static void
-mrb_free_instance(instance *current)
-{
-  mrbc_context_free(current->mrb, current->context);
-  mrb_close(current->mrb);
-  free(current);
+  return mrb_ret;
 }
 
 static mrb_value
-mrb_mrb_eval(mrb_state *mrb, mrb_value self)
+mrb_mrb_eval_file(mrb_state *mrb, mrb_value self)
 {
-  mrb_value code, ret, mrb_ret, application;
+  mrb_value path, application, mrb_ret;
   instance *current;
+  uint8_t *bin;
+  long len;
+  FILE *file;
 
-  mrb_ret = mrb_nil_value();
-  mrb_get_args(mrb, "S|S", &code, &application);
+  mrb_get_args(mrb, "SS", &path, &application);
 
-  current = mrb_alloc_instance(RSTRING_PTR(application), RSTRING_LEN(application), mrb);
-  if (current->outdated) {
-    if (strcmp(RSTRING_PTR(code), "Context.start") >= 0) {
-      ret = mrb_true_value();
-    } else {
-      mrb_free_instance(current);
-      mrb_funcall(mrb, self, "mrb_start", 1, application);
-      current = mrb_alloc_instance(RSTRING_PTR(application), RSTRING_LEN(application), mrb);
-      ret     = mrb_load_nstring_cxt(current->mrb, RSTRING_PTR(code), RSTRING_LEN(code), current->context);
-    }
-  } else {
-    ret = mrb_load_nstring_cxt(current->mrb, RSTRING_PTR(code), RSTRING_LEN(code), current->context);
+  file = fopen(mrb_string_value_cstr(mrb, &path), "rb");
+
+  if (file == NULL) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "could not open %S", path);
   }
 
-  /* 2020-11-23: if starting new mruby contexts isn't natively an asynchronous
-   * operation, it may be a problem to use it as if it was. It's something to
-   * bear in mind along the way. */
+  fseek(file, 0, SEEK_END);
+  len = ftell(file);
+  fseek(file, 0, SEEK_SET);
 
-  if (mrb_undef_p(ret))
-    mrb_ret = mrb_nil_value();
-  else if (mrb_string_p(ret))
-    mrb_ret = mrb_str_new_cstr(mrb, RSTRING_PTR(ret));
-  else
-    mrb_ret = ret;
+  bin = (len > 0) ? (uint8_t *) malloc(len) : NULL;
+
+  if (bin == NULL || fread(bin, 1, len, file) != (size_t) len || !context_irep_check(bin, len)) {
+    free(bin);
+    fclose(file);
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid RITE binary %S", path);
+  }
+
+  fclose(file);
+
+  current = mrb_start_instance(mrb, self, application);
+
+  instance_lock(current);
+
+  mrb_ret = mrb_instance_result(mrb, current, context_eval_irep(current, bin));
+
+  instance_release(current);
+
+  free(bin);
 
   return mrb_ret;
 }
@@ -234,30 +1289,31 @@ static mrb_value
 mrb_mrb_stop(mrb_state *mrb, mrb_value self)
 {
   mrb_value application;
-  int i = 0;
+  instance *current;
+  int removed = 0;
 
   TRACE_FUNCTION();
 
-  pthread_mutex_lock(&context_mutex);
-
   mrb_get_args(mrb, "S", &application);
 
-  while (i < 20) {
-    if (instances[i] != NULL && strcmp(instances[i]->application, RSTRING_PTR(application)) == 0) {
-      if (instances[i]->mrb == mrb) {
-        instances[i]->outdated = TRUE;
-      } else {
-        mrb_free_instance(instances[i]);
-        instances[i] = NULL;
-      }
-      break;
+  pthread_rwlock_wrlock(&context_lock);
+
+  current = registry_find(RSTRING_PTR(application), context_hash(RSTRING_PTR(application), strlen(RSTRING_PTR(application))));
+
+  if (current != NULL) {
+    if (current->mrb == mrb) {
+      current->outdated = TRUE;
+    } else {
+      removed = registry_remove(current);
     }
-    i++;
   }
 
-  TRACE("return");
+  pthread_rwlock_unlock(&context_lock);
 
-  pthread_mutex_unlock(&context_mutex);
+  /* Freed right away unless some other thread is still evaluating on it */
+  if (removed) instance_release(current);
+
+  TRACE("return");
 
   return mrb_nil_value();
 }
@@ -266,83 +1322,309 @@ static mrb_value
 mrb_mrb_expire(mrb_state *mrb, mrb_value self)
 {
   mrb_value application;
-  int i = 0;
+  instance *current;
 
   TRACE_FUNCTION();
 
-  pthread_mutex_lock(&context_mutex);
+  mrb_get_args(mrb, "S", &application);
+
+  current = instance_get(RSTRING_PTR(application));
+
+  if (current != NULL) {
+    current->outdated = TRUE;
+    instance_release(current);
+  }
+
+  TRACE("return");
+
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_latency_stats(mrb_state *mrb, const latencyHistogram *histogram)
+{
+  mrb_value hash = mrb_hash_new(mrb);
+
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "count")), mrb_fixnum_value(histogram->count));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "p50")), mrb_fixnum_value(latency_percentile(histogram, 50)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "p99")), mrb_fixnum_value(latency_percentile(histogram, 99)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "max")), mrb_fixnum_value(histogram->max));
+
+  return hash;
+}
+
+/**
+ * @brief Statistics of a given instance, in a single hash.
+ */
+static mrb_value
+mrb_instance_stats(mrb_state *mrb, instance *current)
+{
+  struct memprof_userdata *ud = current->mrb->allocf_ud;
+  mrb_value hash, latency;
+  int i, size = 0;
+
+  for (i = 0; i < CONTEXT_EVAL_CACHE_SIZE; i++) {
+    if (current->cache.entries[i].proc != NULL) size++;
+  }
+
+  hash = mrb_hash_new(mrb);
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "application")), mrb_str_new_cstr(mrb, current->application));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "outdated")), mrb_bool_value(current->outdated));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "current_memory")), mrb_fixnum_value(MEMPROF_READ(ud->current_size)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "peak_memory")), mrb_fixnum_value(MEMPROF_READ(ud->peak_size)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "slab_chunks")), mrb_fixnum_value(context_slab_chunks(ud->slab)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "live_objects")), mrb_fixnum_value(current->mrb->gc.live));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "evals")), mrb_fixnum_value(__sync_add_and_fetch(&current->eval_cnt, 0)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "eval_time")), mrb_fixnum_value(__sync_add_and_fetch(&current->eval_usec, 0)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "cache_size")), mrb_fixnum_value(size));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "cache_capacity")), mrb_fixnum_value(CONTEXT_EVAL_CACHE_SIZE));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "cache_hits")), mrb_fixnum_value(current->cache.hits));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "cache_misses")), mrb_fixnum_value(current->cache.misses));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "cache_evictions")), mrb_fixnum_value(current->cache.evictions));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "compile_time")), mrb_fixnum_value(current->compile_usec));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "compile_irep_size")), mrb_fixnum_value(current->compile_irep_size));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "load_time")), mrb_fixnum_value(current->load_usec));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "load_irep_size")), mrb_fixnum_value(current->load_irep_size));
+
+  latency = mrb_hash_new(mrb);
+  mrb_hash_set(mrb, latency, mrb_symbol_value(mrb_intern_lit(mrb, "acquire")), mrb_latency_stats(mrb, &current->latency[LATENCY_ACQUIRE]));
+  mrb_hash_set(mrb, latency, mrb_symbol_value(mrb_intern_lit(mrb, "compile")), mrb_latency_stats(mrb, &current->latency[LATENCY_COMPILE]));
+  mrb_hash_set(mrb, latency, mrb_symbol_value(mrb_intern_lit(mrb, "execute")), mrb_latency_stats(mrb, &current->latency[LATENCY_EXECUTE]));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "latency")), latency);
+
+  return hash;
+}
+
+static mrb_value
+mrb_vm_s_instance(mrb_state *mrb, mrb_value self)
+{
+  mrb_value application;
+  mrb_value hash = mrb_nil_value();
+  instance *current;
 
   mrb_get_args(mrb, "S", &application);
 
-  while (i < 20) {
-    if (instances[i] != NULL && strcmp(instances[i]->application, RSTRING_PTR(application)) == 0) {
-      instances[i]->outdated = TRUE;
-      break;
+  current = instance_get(RSTRING_PTR(application));
+
+  if (current != NULL) {
+    hash = mrb_instance_stats(mrb, current);
+
+    instance_release(current);
+  }
+
+  return hash;
+}
+
+static mrb_value
+mrb_vm_s_instances(mrb_state *mrb, mrb_value self)
+{
+  mrb_value array;
+  instance **list;
+  instance *current;
+  size_t i, count = 0;
+  int ai;
+
+  /* Retained under the lock, reported after it (building hashes may raise) */
+
+  pthread_rwlock_rdlock(&context_lock);
+
+  list = (instance **) malloc((registry_count + 1) * sizeof(instance *));
+
+  for (i = 0; list != NULL && i < registry_size; i++) {
+    for (current = registry[i]; current != NULL; current = current->next) {
+      instance_retain(current);
+      list[count++] = current;
     }
-    i++;
   }
 
-  TRACE("return");
+  pthread_rwlock_unlock(&context_lock);
 
-  pthread_mutex_unlock(&context_mutex);
+  if (list == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "could not list instances");
+  }
 
-  return mrb_nil_value();
+  array = mrb_ary_new_capa(mrb, count);
+
+  ai = mrb_gc_arena_save(mrb);
+
+  for (i = 0; i < count; i++) {
+    mrb_ary_push(mrb, array, mrb_instance_stats(mrb, list[i]));
+    mrb_gc_arena_restore(mrb, ai);
+    instance_release(list[i]);
+  }
+
+  free(list);
+
+  return array;
 }
 
 static mrb_value
 mrb_vm_s_mallocs(mrb_state *mrb, mrb_value self)
 {
   struct memprof_userdata *ud = mrb->allocf_ud;
-  return mrb_fixnum_value(ud->malloc_cnt);
+  return mrb_fixnum_value(MEMPROF_READ(ud->malloc_cnt));
 }
 
 static mrb_value
 mrb_vm_s_reallocs(mrb_state *mrb, mrb_value self)
 {
   struct memprof_userdata *ud = mrb->allocf_ud;
-  return mrb_fixnum_value(ud->realloc_cnt);
+  return mrb_fixnum_value(MEMPROF_READ(ud->realloc_cnt));
 }
 
 static mrb_value
 mrb_vm_s_frees(mrb_state *mrb, mrb_value self)
 {
   struct memprof_userdata *ud = mrb->allocf_ud;
-  return mrb_fixnum_value(ud->free_cnt);
+  return mrb_fixnum_value(MEMPROF_READ(ud->free_cnt));
 }
 
 static mrb_value
 mrb_vm_s_free_not_null(mrb_state *mrb, mrb_value self)
 {
   struct memprof_userdata *ud = mrb->allocf_ud;
-  return mrb_fixnum_value(ud->free_cnt - ud->freezero_cnt);
+  return mrb_fixnum_value(MEMPROF_READ(ud->free_cnt) - MEMPROF_READ(ud->freezero_cnt));
 }
 
 static mrb_value
 mrb_vm_s_free_null(mrb_state *mrb, mrb_value self)
 {
   struct memprof_userdata *ud = mrb->allocf_ud;
-  return mrb_fixnum_value(ud->freezero_cnt);
+  return mrb_fixnum_value(MEMPROF_READ(ud->freezero_cnt));
 }
 
 static mrb_value
 mrb_vm_s_total_memory(mrb_state *mrb, mrb_value self)
 {
   struct memprof_userdata *ud = mrb->allocf_ud;
-  return mrb_fixnum_value(ud->total_size);
+  return mrb_fixnum_value(MEMPROF_READ(ud->total_size));
 }
 
 static mrb_value
 mrb_vm_s_objects(mrb_state *mrb, mrb_value self)
 {
   struct memprof_userdata *ud = mrb->allocf_ud;
-  return mrb_fixnum_value(ud->current_objcnt);
+  return mrb_fixnum_value(MEMPROF_READ(ud->current_objcnt));
 }
 
 static mrb_value
 mrb_vm_s_current_memory(mrb_state *mrb, mrb_value self)
 {
-  const struct memprof_userdata *ud = mrb->allocf_ud;
-  return mrb_fixnum_value(ud->current_size);
+  struct memprof_userdata *ud = mrb->allocf_ud;
+  return mrb_fixnum_value(MEMPROF_READ(ud->current_size));
+}
+
+/**
+ * @brief Snapshot of the allocator counters of a state, in a single hash.
+ */
+static mrb_value
+mrb_memprof_stats(mrb_state *mrb, struct memprof_userdata *ud)
+{
+  mrb_value hash, histogram;
+  unsigned int frees, freezero;
+  int i, last = 0;
+
+  hash = mrb_hash_new(mrb);
+
+  frees = MEMPROF_READ(ud->free_cnt);
+  freezero = MEMPROF_READ(ud->freezero_cnt);
+
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "mallocs")), mrb_fixnum_value(MEMPROF_READ(ud->malloc_cnt)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "reallocs")), mrb_fixnum_value(MEMPROF_READ(ud->realloc_cnt)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "frees")), mrb_fixnum_value(frees));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "free_not_null")), mrb_fixnum_value(frees - freezero));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "free_null")), mrb_fixnum_value(freezero));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "total_memory")), mrb_fixnum_value(MEMPROF_READ(ud->total_size)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "objects")), mrb_fixnum_value(MEMPROF_READ(ud->current_objcnt)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "current_memory")), mrb_fixnum_value(MEMPROF_READ(ud->current_size)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "peak_memory")), mrb_fixnum_value(MEMPROF_READ(ud->peak_size)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "soft_limit")), mrb_fixnum_value(MEMPROF_READ(ud->soft_limit)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "hard_limit")), mrb_fixnum_value(MEMPROF_READ(ud->hard_limit)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "rejected")), mrb_fixnum_value(MEMPROF_READ(ud->rejected_cnt)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "slab_chunks")), mrb_fixnum_value(context_slab_chunks(ud->slab)));
+
+  for (i = 0; i < MEMPROF_HISTOGRAM; i++) {
+    if (MEMPROF_READ(ud->size_histogram[i])) last = i;
+  }
+
+  histogram = mrb_ary_new_capa(mrb, last + 1);
+
+  for (i = 0; i <= last; i++) {
+    mrb_ary_push(mrb, histogram, mrb_fixnum_value(MEMPROF_READ(ud->size_histogram[i])));
+  }
+
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "histogram")), histogram);
+
+  return hash;
+}
+
+static mrb_value
+mrb_vm_s_stats(mrb_state *mrb, mrb_value self)
+{
+  return mrb_memprof_stats(mrb, mrb->allocf_ud);
+}
+
+static mrb_value
+mrb_vm_s_memory_limit(mrb_state *mrb, mrb_value self)
+{
+  mrb_value application;
+  mrb_int soft = 0, hard = 0;
+  struct memprof_userdata *ud;
+  instance *current;
+
+  mrb_get_args(mrb, "Sii", &application, &soft, &hard);
+
+  if (soft < 0 || hard < 0 || (hard && soft > hard)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid memory limits");
+  }
+
+  current = instance_get(RSTRING_PTR(application));
+
+  if (current == NULL) return mrb_false_value();
+
+  /* Read by the allocator of the instance, possibly on another thread */
+  ud = current->mrb->allocf_ud;
+  MEMPROF_WRITE(ud->soft_limit, soft);
+  MEMPROF_WRITE(ud->hard_limit, hard);
+
+  instance_release(current);
+
+  return mrb_true_value();
+}
+
+static mrb_value
+mrb_vm_s_set_slow_eval_threshold(mrb_state *mrb, mrb_value self)
+{
+  mrb_int usec = 0;
+
+  mrb_get_args(mrb, "i", &usec);
+
+  slow_eval_usec = (usec > 0) ? usec : 0;
+
+  return mrb_fixnum_value(usec);
+}
+
+static mrb_value
+mrb_vm_s_slow_eval_threshold(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(slow_eval_usec);
+}
+
+static mrb_value
+mrb_vm_s_default_memory_limit(mrb_state *mrb, mrb_value self)
+{
+  mrb_int soft = 0, hard = 0;
+
+  mrb_get_args(mrb, "ii", &soft, &hard);
+
+  if (soft < 0 || hard < 0 || (hard && soft > hard)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid memory limits");
+  }
+
+  memory_soft_limit = soft;
+  memory_hard_limit = hard;
+
+  return mrb_true_value();
 }
 
 /********************/
@@ -363,12 +1645,122 @@ context_memprof_init(mrb_allocf *funp, void **udp)
     abort();
   }
 
+  if (CONTEXT_MEMPROF_SLAB)
+  {
+    ud->slab = context_slab_new(); /* libc only, when NULL */
+  }
+
   *funp = context_memprof_allocf;
   *udp  = ud;
 
   TRACE("return");
 }
 
+/**
+ * @brief Releases what @link context_memprof_init @endlink allocated, once the
+ * state using it is closed.
+ */
+extern void
+context_memprof_final(void *ud0)
+{
+  struct memprof_userdata *ud = ud0;
+
+  TRACE_FUNCTION();
+
+  if (ud != NULL)
+  {
+    context_slab_destroy(ud->slab);
+
+    free(ud);
+  }
+
+  TRACE("return");
+}
+
+/**
+ * @brief Retains the instance of a given application for native callers (no
+ * calling mrb_state). An outdated instance is replaced by a fresh one right
+ * away, since there is no caller to run `mrb_start` from.
+ *
+ * @param application application name
+ *
+ * @return retained instance, to be given back with @link
+ * context_instance_release @endlink, or NULL when it can't be opened
+ */
+extern struct instance *
+context_instance_acquire(const char *application)
+{
+  instance *current;
+
+  current = mrb_alloc_instance((char *) application, strlen(application), NULL);
+
+  if (current != NULL && current->outdated)
+  {
+    instance_retire(current);
+    instance_release(current);
+
+    current = mrb_alloc_instance((char *) application, strlen(application), NULL);
+  }
+
+  return current;
+}
+
+/**
+ * @brief Evaluation lock of a retained instance, held by native callers
+ * around @link context_instance_eval @endlink and any use of its result.
+ */
+extern void
+context_instance_lock(struct instance *current)
+{
+  instance_lock(current);
+}
+
+extern void
+context_instance_unlock(struct instance *current)
+{
+  instance_unlock(current);
+}
+
+extern void
+context_instance_release(struct instance *current)
+{
+  instance_release(current);
+}
+
+/**
+ * @brief Unregisters an instance still retained by a native caller, so the
+ * next acquire of its application opens a fresh one. The retired instance
+ * is freed once its last holder releases it.
+ */
+extern void
+context_instance_retire(struct instance *current)
+{
+  instance_retire(current);
+}
+
+extern mrb_state *
+context_instance_state(struct instance *current)
+{
+  return current->mrb;
+}
+
+/**
+ * @brief Evaluates a snippet in a retained instance, see @link context_eval
+ * @endlink. Must be called with the instance locked (@link
+ * context_instance_lock @endlink). The result belongs to the instance state.
+ */
+extern mrb_value
+context_instance_eval(struct instance *current, const char *code, size_t len)
+{
+  return context_eval(current, code, len);
+}
+
+extern uint32_t
+context_application_hash(const char *application)
+{
+  return context_hash(application, strlen(application));
+}
+
 extern void
 mrb_mruby_context_gem_init(mrb_state *mrb)
 {
@@ -381,7 +1773,7 @@ mrb_mruby_context_gem_init(mrb_state *mrb)
 
   if (!mutex_init)
   {
-    pthread_mutex_init(&context_mutex, NULL);
+    pthread_rwlock_init(&context_lock, NULL);
 
     mutex_init = 1;
   }
@@ -391,6 +1783,8 @@ mrb_mruby_context_gem_init(mrb_state *mrb)
   vm = mrb_define_module(mrb, "Vm");
 
   mrb_define_method(mrb       , krn , "mrb_eval"       , mrb_mrb_eval            , MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb       , krn , "mrb_eval_irep"  , mrb_mrb_eval_irep       , MRB_ARGS_REQ(2));
+  mrb_define_method(mrb       , krn , "mrb_eval_file"  , mrb_mrb_eval_file       , MRB_ARGS_REQ(2));
   mrb_define_method(mrb       , krn , "mrb_stop"       , mrb_mrb_stop            , MRB_ARGS_REQ(1));
   mrb_define_method(mrb       , krn , "mrb_expire"     , mrb_mrb_expire          , MRB_ARGS_REQ(1));
 
@@ -402,6 +1796,21 @@ mrb_mruby_context_gem_init(mrb_state *mrb)
   mrb_define_class_method(mrb , vm  , "total_memory"   , mrb_vm_s_total_memory   , MRB_ARGS_NONE());
   mrb_define_class_method(mrb , vm  , "objects"        , mrb_vm_s_objects        , MRB_ARGS_NONE());
   mrb_define_class_method(mrb , vm  , "current_memory" , mrb_vm_s_current_memory , MRB_ARGS_NONE());
+  mrb_define_class_method(mrb , vm  , "stats"          , mrb_vm_s_stats          , MRB_ARGS_NONE());
+  mrb_define_class_method(mrb , vm  , "instance"       , mrb_vm_s_instance       , MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb , vm  , "instances"      , mrb_vm_s_instances      , MRB_ARGS_NONE());
+  mrb_define_class_method(mrb , vm  , "memory_limit"   , mrb_vm_s_memory_limit   , MRB_ARGS_REQ(3));
+  mrb_define_class_method(mrb , vm  , "default_memory_limit" , mrb_vm_s_default_memory_limit , MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb , vm  , "slow_eval_threshold"  , mrb_vm_s_slow_eval_threshold  , MRB_ARGS_NONE());
+  mrb_define_class_method(mrb , vm  , "slow_eval_threshold=" , mrb_vm_s_set_slow_eval_threshold , MRB_ARGS_REQ(1));
+
+  DONE;
+
+  mrb_context_value_init(mrb);
+
+  DONE;
+
+  mrb_context_eval_pool_init(mrb);
 
   DONE;
 
@@ -409,6 +1818,10 @@ mrb_mruby_context_gem_init(mrb_state *mrb)
 
   DONE;
 
+  mrb_thread_pub_sub_init(mrb);
+
+  DONE;
+
   TRACE("return");
 }
 
@@ -0,0 +1,520 @@
+/**
+ * @file thread_pub_sub.c
+ * @brief mruby-context topic based publish/subscribe between threads.
+ * @platform Pax Prolin
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026 CloudWalk, Inc.
+ *
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mruby.h"
+#include "mruby/ext/context.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+
+/**********/
+/* Macros */
+/**********/
+
+#define PUBSUB_DEFAULT_CAPACITY 1024
+#define PUBSUB_MAX_CAPACITY (PUBSUB_DEFAULT_CAPACITY * 64)
+#define PUBSUB_DROP_NEWEST 1 /* a full queue rejects new events */
+#define PUBSUB_DROP_OLDEST 0 /* a full queue drops its oldest event */
+#define PUBSUB_MAX_SIZE 102400
+#define PUBSUB_SUBSCRIBER_BUCKETS 64
+#define PUBSUB_TOPIC_SIZE 64
+
+/********************/
+/* Type definitions */
+/********************/
+
+/**
+ * @brief Published payload. Stored once and shared, read only, by every
+ * subscriber queue it was delivered to; released with the last reference.
+ */
+typedef struct pubSubEvent
+{
+  int refs;
+  int len;
+  char data[1];
+} pubSubEvent;
+
+typedef struct pubSubSubscriber
+{
+  int id;
+  int policy;
+  int capacity;
+  int head;  /* oldest event */
+  int count;
+  pubSubEvent **queue;
+  unsigned long delivered;
+  unsigned long dropped;
+  struct pubSubTopic *topic;
+  struct pubSubSubscriber *next;   /* topic subscribers */
+  struct pubSubSubscriber *bucket; /* subscriber index chain */
+} pubSubSubscriber;
+
+typedef struct pubSubTopic
+{
+  char name[PUBSUB_TOPIC_SIZE];
+  int subscribers;
+  struct pubSubSubscriber *first;
+  struct pubSubTopic *next;
+} pubSubTopic;
+
+/********************/
+/* Global variables */
+/********************/
+
+/* Static */
+
+static pthread_mutex_t pubsub_mutex;
+
+static pubSubTopic *pubsub_topics = NULL;
+
+static pubSubSubscriber *pubsub_subscribers[PUBSUB_SUBSCRIBER_BUCKETS] = { NULL };
+
+static int pubsub_last_id = -1; /* first subscriber is 0, as it used to be */
+
+/*********************/
+/* Private functions */
+/*********************/
+
+static pubSubEvent *
+pubsub_event_new(const char *buf, int len)
+{
+  pubSubEvent *event = (pubSubEvent *) malloc(offsetof(pubSubEvent, data) + len);
+
+  if (event == NULL) return NULL;
+
+  event->refs = 1;
+  event->len = len;
+
+  memcpy(event->data, buf, len);
+
+  return event;
+}
+
+static void
+pubsub_event_release(pubSubEvent *event)
+{
+  if (event != NULL && __sync_sub_and_fetch(&event->refs, 1) == 0) free(event);
+}
+
+static pubSubTopic *
+pubsub_topic(const char *name, int create)
+{
+  pubSubTopic *topic = pubsub_topics;
+
+  while (topic != NULL && strncmp(topic->name, name, PUBSUB_TOPIC_SIZE) != 0)
+  {
+    topic = topic->next;
+  }
+
+  if (topic == NULL && create)
+  {
+    topic = (pubSubTopic *) calloc(1, sizeof(pubSubTopic));
+
+    if (topic == NULL) return NULL;
+
+    strncpy(topic->name, name, PUBSUB_TOPIC_SIZE - 1);
+
+    topic->next = pubsub_topics;
+
+    pubsub_topics = topic;
+  }
+
+  return topic;
+}
+
+/**
+ * @brief Raises for topic names that don't fit a topic: stored truncated,
+ * they would never be found again.
+ */
+static void
+pubsub_topic_check(mrb_state *mrb, mrb_value topic)
+{
+  if (RSTRING_LEN(topic) <= 0 || RSTRING_LEN(topic) >= PUBSUB_TOPIC_SIZE)
+  {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid topic name size (1 to %S)", mrb_fixnum_value(PUBSUB_TOPIC_SIZE - 1));
+  }
+}
+
+static pubSubSubscriber **
+pubsub_subscriber_link(int id)
+{
+  pubSubSubscriber **link = &pubsub_subscribers[(unsigned int) id % PUBSUB_SUBSCRIBER_BUCKETS];
+
+  while (*link != NULL && (*link)->id != id) link = &(*link)->bucket;
+
+  return link;
+}
+
+static pubSubEvent *
+pubsub_subscriber_shift(pubSubSubscriber *subscriber)
+{
+  pubSubEvent *event;
+
+  if (subscriber->count == 0) return NULL;
+
+  event = subscriber->queue[subscriber->head];
+
+  subscriber->queue[subscriber->head] = NULL;
+  subscriber->head = (subscriber->head + 1) % subscriber->capacity;
+  subscriber->count--;
+
+  return event;
+}
+
+/**
+ * @brief Queues an event for a subscriber (taking a reference), applying its
+ * policy when the queue is full.
+ *
+ * @return 1 when queued or 0, when dropped
+ */
+static int
+pubsub_subscriber_push(pubSubSubscriber *subscriber, pubSubEvent *event)
+{
+  if (subscriber->count == subscriber->capacity)
+  {
+    subscriber->dropped++;
+
+    if (subscriber->policy == PUBSUB_DROP_NEWEST) return 0;
+
+    pubsub_event_release(pubsub_subscriber_shift(subscriber));
+  }
+
+  __sync_add_and_fetch(&event->refs, 1);
+
+  subscriber->queue[(subscriber->head + subscriber->count) % subscriber->capacity] = event;
+  subscriber->count++;
+  subscriber->delivered++;
+
+  return 1;
+}
+
+static void
+pubsub_subscriber_free(pubSubSubscriber *subscriber)
+{
+  while (subscriber->count > 0) pubsub_event_release(pubsub_subscriber_shift(subscriber));
+
+  free(subscriber->queue);
+  free(subscriber);
+}
+
+static int
+subscribe(const char *name, int capacity, int policy)
+{
+  pubSubTopic *topic = pubsub_topic(name, 1);
+  pubSubSubscriber *subscriber;
+
+  if (topic == NULL) return -1;
+
+  subscriber = (pubSubSubscriber *) calloc(1, sizeof(pubSubSubscriber));
+
+  if (subscriber == NULL) return -1;
+
+  subscriber->queue = (pubSubEvent **) calloc(capacity, sizeof(pubSubEvent *));
+
+  if (subscriber->queue == NULL)
+  {
+    free(subscriber);
+
+    return -1;
+  }
+
+  subscriber->id = ++pubsub_last_id;
+  subscriber->capacity = capacity;
+  subscriber->policy = policy;
+  subscriber->topic = topic;
+  subscriber->next = topic->first;
+
+  topic->first = subscriber;
+  topic->subscribers++;
+
+  *pubsub_subscriber_link(subscriber->id) = subscriber;
+
+  return subscriber->id;
+}
+
+static int
+unsubscribe(int id)
+{
+  pubSubSubscriber **link = pubsub_subscriber_link(id);
+  pubSubSubscriber *subscriber = *link, **member;
+
+  if (subscriber == NULL) return 0;
+
+  *link = subscriber->bucket;
+
+  member = &subscriber->topic->first;
+
+  while (*member != subscriber) member = &(*member)->next;
+
+  *member = subscriber->next;
+
+  subscriber->topic->subscribers--;
+
+  pubsub_subscriber_free(subscriber);
+
+  return 1;
+}
+
+/**
+ * @brief Delivers an event to every subscriber of a topic, but the publisher
+ * itself. The event is stored once, whatever the number of subscribers.
+ *
+ * @param event event, created by the caller (its reference is kept)
+ *
+ * @return number of subscribers the event was queued for
+ */
+static int
+pubsub_publish(const char *name, pubSubEvent *event, int avoid_id)
+{
+  pubSubTopic *topic = pubsub_topic(name, 0);
+  pubSubSubscriber *subscriber;
+  int delivered = 0;
+
+  if (topic == NULL) return 0;
+
+  for (subscriber = topic->first; subscriber != NULL; subscriber = subscriber->next)
+  {
+    if (subscriber->id != avoid_id) delivered += pubsub_subscriber_push(subscriber, event);
+  }
+
+  return delivered;
+}
+
+/**************************/
+/* Externalized functions */
+/**************************/
+
+static mrb_value
+mrb_thread_pub_sub_s__listen(mrb_state *mrb, mrb_value self)
+{
+  mrb_int id = 0;
+  pubSubSubscriber *subscriber;
+  pubSubEvent *event = NULL;
+  mrb_value return_value;
+
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "i", &id);
+
+  pthread_mutex_lock(&pubsub_mutex);
+
+  subscriber = *pubsub_subscriber_link(id);
+
+  if (subscriber != NULL) event = pubsub_subscriber_shift(subscriber);
+
+  pthread_mutex_unlock(&pubsub_mutex);
+
+  if (event == NULL) return mrb_nil_value();
+
+  return_value = mrb_str_new(mrb, event->data, event->len);
+
+  pubsub_event_release(event);
+
+  TRACE("return");
+
+  return return_value;
+}
+
+static mrb_value
+mrb_thread_pub_sub_s__publish(mrb_state *mrb, mrb_value self)
+{
+  mrb_int avoid_id = -1;
+  mrb_value topic, buf, avoid = mrb_nil_value();
+  const char *name;
+  pubSubEvent *event;
+  int delivered;
+
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "SS|o", &topic, &buf, &avoid);
+
+  pubsub_topic_check(mrb, topic);
+
+  if (mrb_fixnum_p(avoid)) avoid_id = mrb_fixnum(avoid);
+
+  name = mrb_string_value_cstr(mrb, &topic);
+
+  if (RSTRING_LEN(buf) <= 0 || RSTRING_LEN(buf) > PUBSUB_MAX_SIZE) return mrb_fixnum_value(0);
+
+  event = pubsub_event_new(RSTRING_PTR(buf), RSTRING_LEN(buf));
+
+  if (event == NULL) return mrb_fixnum_value(0);
+
+  pthread_mutex_lock(&pubsub_mutex);
+
+  delivered = pubsub_publish(name, event, avoid_id);
+
+  pthread_mutex_unlock(&pubsub_mutex);
+
+  pubsub_event_release(event);
+
+  TRACE("return");
+
+  return mrb_fixnum_value(delivered);
+}
+
+static mrb_value
+mrb_thread_pub_sub_s__subscribe(mrb_state *mrb, mrb_value self)
+{
+  mrb_int capacity = PUBSUB_DEFAULT_CAPACITY, policy = PUBSUB_DROP_OLDEST;
+  mrb_value topic;
+  const char *name;
+  int id;
+
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "S|ii", &topic, &capacity, &policy);
+
+  pubsub_topic_check(mrb, topic);
+
+  if (capacity <= 0 || capacity > PUBSUB_MAX_CAPACITY)
+  {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid subscriber capacity (1 to %S)", mrb_fixnum_value(PUBSUB_MAX_CAPACITY));
+  }
+
+  name = mrb_string_value_cstr(mrb, &topic);
+
+  pthread_mutex_lock(&pubsub_mutex);
+
+  id = subscribe(name, capacity, (policy == PUBSUB_DROP_NEWEST) ? PUBSUB_DROP_NEWEST : PUBSUB_DROP_OLDEST);
+
+  pthread_mutex_unlock(&pubsub_mutex);
+
+  TRACE("return");
+
+  return mrb_fixnum_value(id);
+}
+
+static mrb_value
+mrb_thread_pub_sub_s__unsubscribe(mrb_state *mrb, mrb_value self)
+{
+  mrb_int id = 0;
+  int ret;
+
+  mrb_get_args(mrb, "i", &id);
+
+  pthread_mutex_lock(&pubsub_mutex);
+
+  ret = unsubscribe(id);
+
+  pthread_mutex_unlock(&pubsub_mutex);
+
+  return mrb_bool_value(ret);
+}
+
+/**
+ * @brief Queue figures of a subscriber, nil when it doesn't exist.
+ */
+static mrb_value
+mrb_thread_pub_sub_s__stats(mrb_state *mrb, mrb_value self)
+{
+  mrb_int id = 0;
+  pubSubSubscriber *subscriber, copy;
+  char topic[PUBSUB_TOPIC_SIZE];
+  mrb_value hash;
+
+  mrb_get_args(mrb, "i", &id);
+
+  pthread_mutex_lock(&pubsub_mutex);
+
+  subscriber = *pubsub_subscriber_link(id);
+
+  if (subscriber != NULL)
+  {
+    copy = *subscriber;
+
+    memcpy(topic, subscriber->topic->name, sizeof(topic));
+  }
+
+  pthread_mutex_unlock(&pubsub_mutex);
+
+  if (subscriber == NULL) return mrb_nil_value();
+
+  hash = mrb_hash_new(mrb);
+
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "topic")), mrb_str_new_cstr(mrb, topic));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "backlog")), mrb_fixnum_value(copy.count));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "capacity")), mrb_fixnum_value(copy.capacity));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "delivered")), mrb_fixnum_value(copy.delivered));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "dropped")), mrb_fixnum_value(copy.dropped));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "policy")), mrb_symbol_value((copy.policy == PUBSUB_DROP_NEWEST) ? mrb_intern_lit(mrb, "drop_newest") : mrb_intern_lit(mrb, "drop_oldest")));
+
+  return hash;
+}
+
+/********************/
+/* Public functions */
+/********************/
+
+/**
+ * @brief Drops every topic and subscriber (communication thread restart).
+ */
+extern void
+thread_pub_sub_reset(void)
+{
+  pubSubTopic *topic, *next_topic;
+  pubSubSubscriber *subscriber, *next;
+
+  pthread_mutex_lock(&pubsub_mutex);
+
+  for (topic = pubsub_topics; topic != NULL; topic = next_topic)
+  {
+    next_topic = topic->next;
+
+    for (subscriber = topic->first; subscriber != NULL; subscriber = next)
+    {
+      next = subscriber->next;
+
+      pubsub_subscriber_free(subscriber);
+    }
+
+    free(topic);
+  }
+
+  pubsub_topics = NULL;
+
+  memset(pubsub_subscribers, 0, sizeof(pubsub_subscribers));
+
+  pthread_mutex_unlock(&pubsub_mutex);
+}
+
+extern void
+mrb_thread_pub_sub_init(mrb_state *mrb)
+{
+  static int mutex_init = 0;
+
+  struct RClass *thread_pub_sub;
+  struct RClass *context;
+
+  TRACE_FUNCTION();
+
+  if (!mutex_init)
+  {
+    pthread_mutex_init(&pubsub_mutex, NULL);
+
+    mutex_init = 1;
+  }
+
+  context        = mrb_define_class(mrb , "Context" , mrb->object_class);
+
+  thread_pub_sub = mrb_define_class_under(mrb, context, "ThreadPubSub", mrb->object_class);
+
+  mrb_define_class_method(mrb , thread_pub_sub , "_listen"      , mrb_thread_pub_sub_s__listen      , MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb , thread_pub_sub , "_publish"     , mrb_thread_pub_sub_s__publish     , MRB_ARGS_ARG(2, 1));
+  mrb_define_class_method(mrb , thread_pub_sub , "_subscribe"   , mrb_thread_pub_sub_s__subscribe   , MRB_ARGS_ARG(1, 2));
+  mrb_define_class_method(mrb , thread_pub_sub , "_unsubscribe" , mrb_thread_pub_sub_s__unsubscribe , MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb , thread_pub_sub , "_stats"       , mrb_thread_pub_sub_s__stats       , MRB_ARGS_REQ(1));
+
+  TRACE("return");
+}
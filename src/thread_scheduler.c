@@ -8,7 +8,9 @@
  *
  */
 
+#include <errno.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,9 +26,13 @@
 
 #include "mruby.h"
 #include "mruby/array.h"
+#include "mruby/class.h"
 #include "mruby/compile.h"
+#include "mruby/data.h"
 #include "mruby/ext/context.h"
+#include "mruby/ext/context_command.h"
 #include "mruby/ext/context_log.h"
+#include "mruby/ext/context_value.h"
 #include "mruby/hash.h"
 #include "mruby/string.h"
 #include "mruby/value.h"
@@ -36,23 +42,47 @@
 /* Macros */
 /**********/
 
-#define CHANNEL_MAX_SIZE 102400
-#define PUB_SUB_MAX_SLOT 10
+#define CHANNEL_MAX_COUNT 32     /* named channels, :send and :recv included */
+#define CHANNEL_MAX_SIZE 102400 /* largest payload, for every channel */
+#define CHANNEL_NAME_SIZE 64
+#define CHANNEL_RECV 1
+#define CHANNEL_SEND 0
+#define EXECUTION_BUCKETS 64
+#define MESSAGE_POOL_CLASSES 5  /* 64, 256, 1024, 4096 and 16384 byte payloads */
+#define MESSAGE_POOL_KEEP 32    /* free messages kept per size class */
+#define MESSAGE_POOL_MIN_SHIFT 6
 #define QUEUE_MAX_SIZE 1024 /* TODO: manage "memory leaking" (forgotten nodes) from (user) aborted operations!? (this could be way smaller) (~8) */
+#define SUPERVISOR_BACKOFF_MAX 60000 /* restart delay cap, also the healthy run that resets it */
+#define SUPERVISOR_BACKOFF_MIN 500
+#define SUPERVISOR_FAILURE_SIZE 64
+#define SUPERVISOR_PERIOD 250
+#define RING_SLOT(channel, n) (((channel)->head + (n)) % (channel)->capacity)
+#define INDEX_BUCKET(channel, id) ((unsigned int) (id) % (unsigned int) (channel)->capacity)
 #define THREAD_BLOCK 0
 #define THREAD_COMMAND_MAX_MSG_SIZE 102400
 #define THREAD_COMMUNICATION 1
 #define THREAD_FREE 1
+#define THREAD_MAX_COUNT 16 /* live named workers, status bar and communication included */
+#define THREAD_NAME_SIZE 32
 #define THREAD_STATUS_ALIVE 1
 #define THREAD_STATUS_BAR 0
 #define THREAD_STATUS_BLOCK 5
 #define THREAD_STATUS_DEAD 0
 #define THREAD_STATUS_PAUSE 4
+#define THREAD_SEM_TIMEOUT 1000 /* pause/continue/stop wait for the token */
 
 /********************/
 /* Type definitions */
 /********************/
 
+/**
+ * @brief Thread control. The semaphore (sem) is a token guarding status: it
+ * is taken by @link context_thread_sem_wait @endlink, waiting up to a given
+ * timeout, and given back by @link context_thread_sem_push @endlink. Both,
+ * and every status change, go through mutex so waiters block on cond instead
+ * of spinning. Control structures are reused, never released, so a waiter
+ * can't be left with a dangling one.
+ */
 typedef struct thread
 {
   char command[256];
@@ -60,1038 +90,3054 @@ typedef struct thread
   int id;
   int sem;
   int status;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
 } thread;
 
-typedef struct
+/**
+ * @brief Channel message, allocated at its payload size (see
+ * @link message_alloc @endlink).
+ */
+typedef struct message
 {
-  char data[51200];
+  struct message *next; /* channel index chain or pool free list */
   int id;
   int len;
+  int pool;             /* size class or -1, when not pooled */
+  int slot;             /* ring slot, while queued */
+  char data[1];
 } message;
 
+typedef struct messagePool
+{
+  message *free;
+  int count;
+} messagePool;
+
+/**
+ * @brief Bounded ring of messages. Keyed dequeues may leave holes (NULL
+ * slots) behind, which are trimmed at both ends and compacted only when the
+ * ring runs out of slots. Messages are also chained by event ID on a hash
+ * index (newest first), so correlated reads don't scan the ring.
+ */
+typedef struct threadChannel
+{
+  char name[CHANNEL_NAME_SIZE];
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;     /* signaled on every push */
+  struct shmRing *shared;  /* set for shared channels, which don't use the
+                            * ring below (FIFO, not indexed by event ID) */
+  message **ring;
+  message **index; /* capacity buckets */
+  int capacity;
+  int head;  /* oldest slot */
+  int count; /* slots from head to the newest node, holes included */
+  int live;  /* nodes */
+} threadChannel;
+
+/**
+ * @brief Command exchanged with the communication thread, one per command
+ * ID. Kept once consumed, so its buffers are reused by the next exchange.
+ */
 typedef struct executionMessage
 {
   char *command;
   char *response;
   int commandLen;
+  int commandSize;
   int executed;
   int id;
+  int opcode; /* binary commands, keyed by call ID */
   int responseLen;
+  int responseSize;
+  unsigned int responses; /* stored so far, tells a fresh one apart */
   struct executionMessage *front;
   struct executionMessage *rear;
+  struct executionMessage *bucket; /* index chain */
 } executionMessage;
 
+/**
+ * @brief Pending request (ThreadScheduler::Request): a command or opcode and
+ * the number of responses it had when the request was queued.
+ */
+typedef struct commandRequest
+{
+  int binary;
+  int id;
+  int thread; /* worker queue, for string commands */
+  unsigned int responses;
+} commandRequest;
+
+typedef struct commandHandler
+{
+  context_command_handler handler;
+  void *data;
+} commandHandler;
+
 typedef struct threadExecutionQueue
 {
   int size;
   struct executionMessage *first;
   struct executionMessage *last;
+  struct executionMessage *index[EXECUTION_BUCKETS];
 } threadExecutionQueue;
 
-/********************/
-/* Global variables */
-/********************/
+/**
+ * @brief Named worker thread: its control and the queue of string commands
+ * sent to it. ID 0 is the status bar and 1 the communication thread.
+ */
+typedef struct threadWorker
+{
+  char name[THREAD_NAME_SIZE];
+  thread *control;
+  threadExecutionQueue *queue;
+  unsigned int generation; /* bumped on every spawn */
+  int attached;            /* a native thread runs the current generation */
+  int running;             /* native threads still running a snippet */
+  int ran;                 /* started since registered (slot reusable once dead) */
+  struct instance *current; /* instance of the running snippet */
+  /* Supervision (workers spawned with a snippet, until stopped) */
+  char *code;
+  size_t len;
+  int stall_msec;          /* 0: no heartbeat required */
+  int failed;              /* waiting for restart_at */
+  unsigned int restarts;
+  unsigned long long heartbeat;
+  unsigned long long started;
+  unsigned long long restart_at;
+  unsigned long long backoff;
+  char failure[SUPERVISOR_FAILURE_SIZE];
+} threadWorker;
 
 /**
- * @brief (deprecated) Marker for indexes in @link conn_thread_events @endlink.
- * It says if a given index is ready to be used (1) or not (0). <br>
- * <em> Kept to facilitate refactoring efforts (2020, Nov) (disposable) </em>
+ * @brief Snippet run by a native worker, on its own instance.
  */
-static int conn_thread_events_marker[PUB_SUB_MAX_SLOT] = { 0 };
+typedef struct threadSpawn
+{
+  int id;
+  unsigned int generation;
+  size_t len;
+  char application[THREAD_NAME_SIZE + 8];
+  char code[1];
+} threadSpawn;
+
+/********************/
+/* Global variables */
+/********************/
 
 static pthread_mutex_t command_exchange_mutex;
 
-static pthread_mutex_t message_exchange_mutex;
+static pthread_cond_t command_exchange_cond; /* signaled on every response */
 
-static message *conn_thread_events[PUB_SUB_MAX_SLOT][QUEUE_MAX_SIZE] = { { NULL }, { NULL }, { NULL }, { NULL }, { NULL }, { NULL }, { NULL }, { NULL }, { NULL }, { NULL } };
+static pthread_mutex_t channel_registry_mutex;
 
-static message *message_recv_queue[QUEUE_MAX_SIZE] = { NULL };
+static pthread_mutex_t thread_control_mutex;
 
-static message *message_send_queue[QUEUE_MAX_SIZE] = { NULL };
+static pthread_cond_t thread_exit_cond; /* signaled when a native worker returns */
 
-static thread *CommunicationThread = NULL;
+static pthread_cond_t supervisor_cond;
 
-static thread *StatusBarThread = NULL;
+static int supervisor_started = 0;
 
-static threadExecutionQueue *executionQueue = NULL;
+/* Native worker run by the calling thread (-1 for any other thread) */
+static __thread int worker_self_id = -1;
 
-/*********************/
-/* Private functions */
-/*********************/
+static __thread unsigned int worker_self_generation = 0;
+
+static pthread_mutex_t message_pool_mutex;
+
+static messagePool message_pool[MESSAGE_POOL_CLASSES];
+
+static int channel_event_id = 0;
 
 /**
- * @brief Searches for a node in a given queue and retrieves its data: <br>
- * - When node ID is NULL, dequeues the most recent one;
- * - When node ID is ZERO, dequeues the most recent one and updates the ID.
- *
- * @param queue given message queue
- * @param id node ID
- * @param buf dequeued node content
- *
- * @return dequeued node content length or 0, otherwise
+ * @brief Named channels, indexed by their internal ID. Entries are set once,
+ * under @link channel_registry_mutex @endlink, and never released: channels
+ * are shared by every instance and live as long as the process.
  */
-static int
-thread_channel_dequeue(message *queue[], int *id, char *buf)
-{
-  int i = QUEUE_MAX_SIZE;
-  int length;
+static threadChannel *channel_registry[CHANNEL_MAX_COUNT] = { NULL };
 
-  TRACE_FUNCTION();
+static int channel_registry_count = 0;
 
-  if (!queue || !buf)
-  {
-    TRACE("return [0]");
+/**
+ * @brief Named workers, indexed by their internal ID. Entries are set under
+ * @link thread_control_mutex @endlink and never released (a full registry
+ * renames the slot of a worker that is over, see @link
+ * thread_worker_reusable @endlink); their queues are replaced on start,
+ * under @link command_exchange_mutex @endlink.
+ */
+static threadWorker thread_registry[THREAD_MAX_COUNT];
 
-    return 0;
-  }
+static int thread_registry_count = 0;
 
-  while (!queue[--i]); /* 2020-11-25: would be better to know the current size
-                        * beforehand, but its not time consuming */
+/**
+ * @brief Binary commands (see context_command.h), keyed by call ID: every
+ * call has its own entry, whatever its opcode.
+ */
+static threadExecutionQueue *opcodeQueue = NULL;
 
-  while (queue[i] && i >= 0)
-  {
-    TRACE("*id [%d], queue[%d]->id [%d]", (!id) ? 0 : *id, i, queue[i]->id);
+static int command_call_id = 0;
 
-    if (id == NULL || *id == 0 || queue[i]->id == *id)
-    {
-      if (!(queue[i]->len))
-      {
-        continue;
-      }
+static commandHandler command_handlers[CONTEXT_COMMAND_MAX_OPCODE + 1];
 
-      if (id != NULL) (*id) = queue[i]->id;
+/***********************/
+/* Function prototypes */
+/***********************/
 
-      length = queue[i]->len;
+extern struct shmRing *context_shm_ring_open(const char *name, size_t size);
 
-      memcpy(buf, queue[i]->data, length);
+extern int context_shm_ring_write(struct shmRing *ring, int id, const char *buf, int len);
 
-      TRACE("%*.*s", length, length, buf);
+extern int context_shm_ring_peek(struct shmRing *ring, int *id);
 
-      free(queue[i]);
+extern void context_shm_ring_take(struct shmRing *ring, char *buf);
 
-      while (i++ < (QUEUE_MAX_SIZE - 1)) 
-      {
-        queue[i - 1] = queue[i];
+extern int context_shm_ring_wait(struct shmRing *ring, int timeout_msec);
 
-        if (!queue[i]) break; /* 2020-11-24: no need to go through the entire
-                               * queue (sorted) */
-      }
+extern void thread_pub_sub_reset(void);
 
-      queue[--i] = NULL;
+extern struct instance *context_instance_acquire(const char *application);
 
-      TRACE("return [%d]", length);
+extern void context_instance_release(struct instance *current);
 
-      return length;
-    }
+extern void context_instance_lock(struct instance *current);
 
-    i--;
-  }
+extern void context_instance_unlock(struct instance *current);
 
-  TRACE("return [0]");
+extern mrb_state *context_instance_state(struct instance *current);
 
-  return 0;
-}
+extern mrb_value context_instance_eval(struct instance *current, const char *code, size_t len);
+
+extern void context_instance_retire(struct instance *current);
+
+static void thread_execution_clean(threadExecutionQueue *queue);
+
+/*********************/
+/* Private functions */
+/*********************/
+
+static const struct mrb_data_type command_request_type = { "Request", mrb_free };
 
 /**
- * @brief Enqueues a node in a given queue. Queue is kept sorted from the
- * oldest to the newest node to be enqueued.
- * 
- * @param queue given message queue
- * @param id node ID
- * @param buf node content
- * @param len node content length
- * 
- * @return int enqueued node content length or 0, otherwise
+ * @brief Absolute (CLOCK_MONOTONIC) deadline for timed condition waits, so
+ * setting the terminal clock doesn't stretch or cut the timeouts.
  */
-static int
-thread_channel_enqueue(message *queue[], int id, char *buf, int len)
+static void
+thread_deadline(struct timespec *deadline, mrb_int timeout_msec)
 {
-  int i;
-  message *node;
-
-  TRACE_FUNCTION();
+  clock_gettime(CLOCK_MONOTONIC, deadline);
 
-  if (len <= 0 || len >= CHANNEL_MAX_SIZE)
+  if (timeout_msec > 0)
   {
-    TRACE("return [%d]", len);
+    deadline->tv_sec += timeout_msec / 1000;
+    deadline->tv_nsec += (timeout_msec % 1000) * 1000000;
 
-    return 0;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+      deadline->tv_sec++;
+      deadline->tv_nsec -= 1000000000;
+    }
   }
+}
 
-  if (!queue || !buf)
-  {
-    TRACE("return [%d]", len);
+/**
+ * @brief Initializes a condition whose timed waits take thread_deadline().
+ */
+static void
+thread_cond_init(pthread_cond_t *cond)
+{
+  pthread_condattr_t attr;
 
-    return 0;
-  }
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
 
-  node = (message *) calloc(1, sizeof(message));
+static unsigned long long
+thread_clock_msec(void)
+{
+  struct timespec ts;
 
-  if (!node)
-  {
-    TRACE("return [%d]", len);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    return 0;
-  }
+  return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-  node->id = id;
+static int
+message_pool_class(int len)
+{
+  int pool = 0;
 
-  memcpy(node->data, buf, len);
+  while (pool < MESSAGE_POOL_CLASSES && len > (1 << (MESSAGE_POOL_MIN_SHIFT + 2 * pool)))
+  {
+    pool++;
+  }
 
-  TRACE("%*.*s", len, len, node->data);
+  return (pool < MESSAGE_POOL_CLASSES) ? pool : -1;
+}
 
-  node->len = len;
+/**
+ * @brief Allocates a message able to hold a payload of a given length.
+ * Payloads up to the largest size class are served from per class free
+ * lists, larger ones straight from libc.
+ *
+ * @param len payload length
+ *
+ * @return message or NULL, when out of memory
+ */
+static message *
+message_alloc(int len)
+{
+  int pool = message_pool_class(len);
+  message *node = NULL;
 
-  i = -1;
+  if (pool >= 0)
+  {
+    pthread_mutex_lock(&message_pool_mutex);
 
-  while (queue[++i] && i < QUEUE_MAX_SIZE); /* 2020-11-24: will enqueue at
-                                                 * the back */
+    node = message_pool[pool].free;
 
-  if (i >= QUEUE_MAX_SIZE)
-  {
-    free(node);
+    if (node != NULL)
+    {
+      message_pool[pool].free = node->next;
+      message_pool[pool].count--;
+    }
 
-    TRACE("return [0]");
+    pthread_mutex_unlock(&message_pool_mutex);
 
-    return 0;
+    if (node == NULL)
+    {
+      node = (message *) malloc(offsetof(message, data) + (1 << (MESSAGE_POOL_MIN_SHIFT + 2 * pool)));
+    }
+  }
+  else
+  {
+    node = (message *) malloc(offsetof(message, data) + len);
   }
 
-  queue[i] = (void *) node;
-
-  TRACE("queue[%d]->id [%d], return [%d]", i, queue[i]->id, len);
+  if (node != NULL)
+  {
+    node->next = NULL;
+    node->pool = pool;
+  }
 
-  return len;
+  return node;
 }
 
-static thread *
-context_thread_new(int id, int status)
+static void
+message_free(message *node)
 {
-  thread *threadControl = (thread *) malloc(sizeof(thread));
+  if (node == NULL) return;
 
-  threadControl->id = id;
-  threadControl->sem = THREAD_BLOCK;
-  threadControl->status = status;
-  memset(threadControl->response, 0, sizeof(threadControl->response));
-  memset(threadControl->command, 0, sizeof(threadControl->command));
+  if (node->pool >= 0)
+  {
+    pthread_mutex_lock(&message_pool_mutex);
 
-  return threadControl;
+    if (message_pool[node->pool].count < MESSAGE_POOL_KEEP)
+    {
+      node->next = message_pool[node->pool].free;
+      message_pool[node->pool].free = node;
+      message_pool[node->pool].count++;
+
+      node = NULL;
+    }
+
+    pthread_mutex_unlock(&message_pool_mutex);
+  }
+
+  free(node);
 }
 
+/**
+ * @brief Compacts the live nodes of a ring to its front, dropping the holes
+ * left by keyed dequeues. Only needed when the ring runs out of free slots.
+ */
 static void
-context_thread_sem_push(thread *threadControl)
+thread_channel_compact(threadChannel *channel)
 {
-  if (threadControl) threadControl->sem = THREAD_FREE;
-}
+  int n, live = 0;
+  message *node;
 
-static int
-context_thread_sem_wait(thread *threadControl, int timeout_msec)
-{
-  (void) timeout_msec;
+  for (n = 0; n < channel->count; n++)
+  {
+    node = channel->ring[RING_SLOT(channel, n)];
 
-  if (threadControl) {
-    if (threadControl->sem == THREAD_BLOCK) {
-      return -1;
-    }
+    if (node == NULL) continue;
 
-    threadControl->sem = THREAD_BLOCK;
+    channel->ring[RING_SLOT(channel, n)] = NULL;
+    channel->ring[RING_SLOT(channel, live)] = node;
+
+    node->slot = RING_SLOT(channel, live++);
   }
 
-  return 1;
+  channel->count = live;
 }
 
-static int
-context_thread_continue(thread *threadControl)
+/**
+ * @brief Drops the holes at both ends of a ring, so its oldest and newest
+ * slots are always taken (or the ring is empty).
+ */
+static void
+thread_channel_trim(threadChannel *channel)
 {
-  if (threadControl != NULL && threadControl->status == THREAD_STATUS_PAUSE) {
-    context_thread_sem_wait(threadControl, 0);
-    threadControl->status = THREAD_STATUS_ALIVE;
-    context_thread_sem_push(threadControl);
-    return 1;
-  } else {
-    return 0;
+  while (channel->count > 0 && channel->ring[RING_SLOT(channel, channel->count - 1)] == NULL)
+  {
+    channel->count--;
   }
-}
-
-static int
-context_thread_pause(thread *threadControl)
-{
-  int ret = 0;
 
-  if (threadControl != NULL && threadControl->status != THREAD_STATUS_DEAD) {
-    context_thread_sem_wait(threadControl, 0);
-    if (threadControl->status == THREAD_STATUS_ALIVE) {
-      threadControl->status = THREAD_STATUS_PAUSE;
-      ret = 1;
-    }
-    context_thread_sem_push(threadControl);
+  while (channel->count > 0 && channel->ring[channel->head] == NULL)
+  {
+    channel->head = (channel->head + 1) % channel->capacity;
+    channel->count--;
   }
-
-  return ret;
 }
 
+/**
+ * @brief Takes a node out of a given channel (ring and index).
+ */
 static void
-thread_channel_clean(message *queue)
+thread_channel_detach(threadChannel *channel, message *node)
 {
-  char trash[CHANNEL_MAX_SIZE] = { 0x00 };
-  int id;
-  int len = 1;
+  message **link = &channel->index[INDEX_BUCKET(channel, node->id)];
 
-  while (len != 0)
-  {
-    id = 0;
+  while (*link != NULL && *link != node) link = &(*link)->next;
 
-    memset(trash, 0, sizeof(trash));
+  if (*link != NULL) *link = node->next;
 
-    len = thread_channel_dequeue(&queue, &id, trash);
-  }
+  node->next = NULL;
+
+  channel->ring[node->slot] = NULL;
+  channel->live--;
+
+  thread_channel_trim(channel);
 }
 
-static int
-subscribe(void)
+/**
+ * @brief Searches for a node in a given channel and takes it out: <br>
+ * - When node ID is NULL or ZERO, takes the most recent one;
+ * - Otherwise, takes the most recent one with the given ID (index lookup).
+ *
+ * The node is handed over as is, so its payload is copied only once, by the
+ * caller, straight into a string (and outside of the channel lock).
+ *
+ * @param channel given channel
+ * @param id node ID
+ *
+ * @return node, to be released by @link message_free @endlink, or NULL
+ */
+static message *
+thread_channel_dequeue(threadChannel *channel, const int *id)
 {
-  int i = 0;
+  message *node;
+
+  TRACE_FUNCTION();
 
-  while (conn_thread_events_marker[i++])
+  if (!channel || !channel->ring || channel->live == 0)
   {
-    if (i >= 10)
-    {
-      i = -1;
+    TRACE("return [NULL]");
 
-      break;
-    }
+    return NULL;
   }
 
-  if (i >= 0)
+  if (id == NULL || *id == 0)
   {
-    conn_thread_events_marker[i] = 1;
+    node = channel->ring[RING_SLOT(channel, channel->count - 1)]; /* trimmed */
   }
+  else
+  {
+    node = channel->index[INDEX_BUCKET(channel, *id)];
 
-  return i;
-}
+    while (node != NULL && node->id != *id) node = node->next;
+  }
 
-static int
-pubsub_publish(char *buf, int len, int target_id)
-{
-  int id = 0, ret = 0;
+  if (node != NULL) thread_channel_detach(channel, node);
 
-  while (id < 10)
-  {
-    if (conn_thread_events_marker[id] && id == target_id)
-    {
-      ret = thread_channel_enqueue(conn_thread_events[id], 0, buf, len);
-    }
-    id++;
-  }
+  TRACE("return [%d]", (node) ? node->len : 0);
 
-  return ret;
+  return node;
 }
 
-static int
-pubsub_listen(int id, char *buf)
+/**
+ * @brief String holding a node payload. The node is released.
+ */
+static mrb_value
+message_to_str(mrb_state *mrb, message *node)
 {
-  int event = 0;
+  mrb_value str = mrb_str_new(mrb, node->data, node->len);
 
-  if (conn_thread_events_marker[id])
-  {
-    return thread_channel_dequeue(conn_thread_events[id], &event, buf);
-  }
+  message_free(node);
 
-  return 0;
+  return str;
 }
 
-static threadExecutionQueue *
-thread_execution_new(void)
+/**
+ * @brief Creates a message holding a copy of a given payload.
+ *
+ * @return message or NULL, when the payload is empty, too large or there's
+ * no memory left
+ */
+static message *
+message_new(int id, const char *buf, int len)
 {
-  threadExecutionQueue *queue = (threadExecutionQueue *) malloc(sizeof(threadExecutionQueue));
+  message *node;
 
-  queue->size = 0;
-  queue->first = NULL;
-  queue->last = NULL;
+  if (len <= 0 || len > CHANNEL_MAX_SIZE || !buf) return NULL;
 
-  return queue;
-}
+  node = message_alloc(len);
 
-static executionMessage *
-thread_execution_message_new(int id)
-{
-  executionMessage *message = (executionMessage *) malloc(sizeof(executionMessage));
+  if (!node) return NULL;
 
-  message->command = NULL;
-  message->response = NULL;
-  message->commandLen = 0;
-  message->executed = 0;
-  message->id = id;
-  message->responseLen = 0;
-  message->front = NULL;
-  message->rear = NULL;
+  node->id = id;
+  node->len = len;
 
-  return message;
+  memcpy(node->data, buf, len);
+
+  return node;
 }
 
+/**
+ * @brief Appends a message to a given channel. Nodes are kept from the
+ * oldest (ring head) to the newest one.
+ *
+ * @return 1 when queued or 0, when the channel is full
+ */
 static int
-thread_execution_get(threadExecutionQueue *queue, int id, int command, char *buf)
+thread_channel_push(threadChannel *channel, message *node)
 {
-  int len = 0;
-  executionMessage *message = NULL;
-  executionMessage *local = NULL;
-
-  /* Search for already schedule execution */
-  if (queue && queue->size > 0) {
-    local = queue->first;
-    while (local != NULL) {
-      if (local->id == id) {
-        message = local;
-        break;
-      }
-      local = local->rear;
-    }
+  if (channel->count == channel->capacity && channel->live < channel->count)
+  {
+    thread_channel_compact(channel);
   }
-  if (message == NULL) return len;
 
-  /* Get information inside of struct synchronizing */
-  if (command == 0 && message->commandLen >= 0 && message->executed == 0) {
-    if (message->commandLen > 0) {
-      memcpy(buf, message->command, message->commandLen);
-      len = message->commandLen;
-      message->executed = 0;
-    }
-  } else if (command == 1 && message->responseLen >= 0 && message->executed == 1) {
-    if (message->responseLen > 0) {
-      memcpy(buf, message->response, message->responseLen);
-      len = message->responseLen;
-      message->executed = 1;
-    }
-  }
+  if (channel->count == channel->capacity) return 0;
 
-  return len;
+  node->slot = RING_SLOT(channel, channel->count);
+  node->next = channel->index[INDEX_BUCKET(channel, node->id)];
+
+  channel->index[INDEX_BUCKET(channel, node->id)] = node;
+  channel->ring[node->slot] = node;
+  channel->count++;
+  channel->live++;
+
+  pthread_cond_broadcast(&channel->cond);
+
+  return 1;
 }
 
-static int
-thread_execution_enqueue(threadExecutionQueue *queue, int id, int command, char *buf, int len)
+/**
+ * @brief Takes the oldest message out of a given channel.
+ *
+ * @return message or NULL, when the channel is empty
+ */
+static message *
+thread_channel_shift(threadChannel *channel)
 {
-  executionMessage *message = NULL;
-  executionMessage *local = NULL;
+  message *node;
 
-  if (queue == NULL) return 0;
+  if (!channel || !channel->ring || channel->live == 0) return NULL;
 
-  /* Search for already schedule execution */
-  if (queue && queue->size > 0) {
-    local = queue->first;
-    while (local != NULL) {
-      if (local->id == id) {
-        message = local;
-        break;
-      }
-      local = local->rear;
-    }
-  }
+  node = channel->ring[channel->head]; /* trimmed */
 
-  if (message != NULL) {
+  thread_channel_detach(channel, node);
+
+  return node;
+}
+
+/**
+ * @brief Takes the oldest record out of a given shared channel into a
+ * message, so its string is only created once the channel is unlocked.
+ *
+ * @return message or NULL, when the ring is empty or there's no memory left
+ * (the record is kept)
+ */
+static message *
+thread_channel_shift_shared(threadChannel *channel)
+{
+  message *node;
+  int id = 0, len = context_shm_ring_peek(channel->shared, &id);
+
+  if (len <= 0) return NULL;
+
+  node = message_alloc(len);
+
+  if (!node) return NULL;
+
+  node->id = id;
+  node->len = len;
+
+  context_shm_ring_take(channel->shared, node->data);
+
+  return node;
+}
+
+/**
+ * @brief Enqueues a node in a given channel.
+ *
+ * @param channel given channel
+ * @param id node ID
+ * @param buf node content
+ * @param len node content length
+ *
+ * @return int enqueued node content length or 0, otherwise
+ */
+static int
+thread_channel_enqueue(threadChannel *channel, int id, char *buf, int len)
+{
+  message *node;
+
+  TRACE_FUNCTION();
+
+  if (!channel || !channel->ring)
+  {
+    TRACE("return [0]");
+
+    return 0;
+  }
+
+  node = message_new(id, buf, len);
+
+  if (!node)
+  {
+    TRACE("return [0]");
+
+    return 0;
+  }
+
+  TRACE("%*.*s", len, len, node->data);
+
+  if (!thread_channel_push(channel, node))
+  {
+    message_free(node);
+
+    TRACE("return [0]");
+
+    return 0;
+  }
+
+  TRACE("id [%d], return [%d]", id, len);
+
+  return len;
+}
+
+static int
+thread_channel_init(threadChannel *channel, int capacity)
+{
+  pthread_mutex_init(&channel->mutex, NULL);
+  thread_cond_init(&channel->cond);
+
+  channel->ring = (message **) calloc(capacity, sizeof(message *));
+  channel->index = (message **) calloc(capacity, sizeof(message *));
+
+  if (channel->ring == NULL || channel->index == NULL)
+  {
+    free(channel->ring);
+    free(channel->index);
+
+    channel->ring = NULL;
+    channel->index = NULL;
+
+    return 0;
+  }
+
+  channel->capacity = capacity;
+  channel->head = 0;
+  channel->count = 0;
+  channel->live = 0;
+
+  return 1;
+}
+
+/**
+ * @brief Drops every node of a given channel.
+ */
+static void
+thread_channel_clean(threadChannel *channel)
+{
+  int n;
+
+  if (!channel || !channel->ring) return;
+
+  for (n = 0; n < channel->count; n++)
+  {
+    message_free(channel->ring[RING_SLOT(channel, n)]);
+
+    channel->ring[RING_SLOT(channel, n)] = NULL;
+  }
+
+  memset(channel->index, 0, channel->capacity * sizeof(message *));
+
+  channel->head = 0;
+  channel->count = 0;
+  channel->live = 0;
+}
+
+/**
+ * @brief Internal ID of a named channel.
+ *
+ * @param name channel name
+ *
+ * @return channel ID or -1, when there's no such channel
+ */
+static int
+thread_channel_find(const char *name)
+{
+  int i;
+
+  for (i = 0; i < channel_registry_count; i++)
+  {
+    if (strncmp(channel_registry[i]->name, name, CHANNEL_NAME_SIZE) == 0) return i;
+  }
+
+  return -1;
+}
+
+/**
+ * @brief Creates a named channel, or finds it when it already exists (its
+ * capacity is kept).
+ *
+ * @param name channel name
+ * @param capacity maximum number of queued messages or, for shared channels,
+ * ring size in bytes
+ * @param shared shared memory ring name, NULL for a channel local to the
+ * process
+ *
+ * @return channel ID or -1, when the registry is full or out of memory
+ */
+static int
+thread_channel_create(const char *name, int capacity, const char *shared)
+{
+  threadChannel *channel;
+  int id, ok;
+
+  pthread_mutex_lock(&channel_registry_mutex);
+
+  id = thread_channel_find(name);
+
+  if (id < 0 && channel_registry_count < CHANNEL_MAX_COUNT)
+  {
+    channel = (threadChannel *) calloc(1, sizeof(threadChannel));
+
+    if (channel != NULL && shared != NULL)
+    {
+      pthread_mutex_init(&channel->mutex, NULL);
+      thread_cond_init(&channel->cond);
+
+      channel->shared = context_shm_ring_open(shared, capacity);
+
+      ok = (channel->shared != NULL);
+    }
+    else
+    {
+      ok = (channel != NULL && thread_channel_init(channel, capacity));
+    }
+
+    if (ok)
+    {
+      strncpy(channel->name, name, CHANNEL_NAME_SIZE - 1);
+
+      id = channel_registry_count;
+
+      channel_registry[id] = channel;
+
+      __sync_synchronize(); /* entry set before the count is seen */
+
+      channel_registry_count++;
+    }
+    else
+    {
+      free(channel);
+    }
+  }
+
+  pthread_mutex_unlock(&channel_registry_mutex);
+
+  return id;
+}
+
+static threadChannel *
+thread_channel_get(mrb_int id)
+{
+  if (id < 0 || id >= channel_registry_count) return NULL;
+
+  return channel_registry[id];
+}
+
+static void
+thread_channel_reset(int id)
+{
+  threadChannel *channel = thread_channel_get(id);
+
+  if (channel == NULL) return;
+
+  pthread_mutex_lock(&channel->mutex);
+
+  thread_channel_clean(channel);
+
+  pthread_mutex_unlock(&channel->mutex);
+}
+
+static thread *
+context_thread_new(int id, int status)
+{
+  thread *threadControl = (thread *) malloc(sizeof(thread));
+
+  if (threadControl == NULL) return NULL;
+
+  pthread_mutex_init(&threadControl->mutex, NULL);
+  thread_cond_init(&threadControl->cond);
+
+  threadControl->id = id;
+  threadControl->sem = THREAD_BLOCK;
+  threadControl->status = status;
+  memset(threadControl->response, 0, sizeof(threadControl->response));
+  memset(threadControl->command, 0, sizeof(threadControl->command));
+
+  return threadControl;
+}
+
+/**
+ * @brief Restarts a thread control, keeping its synchronization primitives
+ * (the token is taken, as by @link context_thread_new @endlink).
+ */
+static thread *
+context_thread_reset(thread *threadControl, int id, int status)
+{
+  if (threadControl == NULL) return context_thread_new(id, status);
+
+  pthread_mutex_lock(&threadControl->mutex);
+
+  threadControl->id = id;
+  threadControl->sem = THREAD_BLOCK;
+  threadControl->status = status;
+  memset(threadControl->response, 0, sizeof(threadControl->response));
+  memset(threadControl->command, 0, sizeof(threadControl->command));
+
+  pthread_cond_broadcast(&threadControl->cond);
+
+  pthread_mutex_unlock(&threadControl->mutex);
+
+  return threadControl;
+}
+
+static void
+context_thread_sem_push(thread *threadControl)
+{
+  if (threadControl == NULL) return;
+
+  pthread_mutex_lock(&threadControl->mutex);
+
+  threadControl->sem = THREAD_FREE;
+
+  pthread_cond_broadcast(&threadControl->cond);
+
+  pthread_mutex_unlock(&threadControl->mutex);
+}
+
+/**
+ * @brief Takes the thread control token.
+ *
+ * @param threadControl given thread
+ * @param timeout_msec timeout in milliseconds, negative to wait forever
+ *
+ * @return 1 when taken or -1, on timeout
+ */
+static int
+context_thread_sem_wait(thread *threadControl, int timeout_msec)
+{
+  struct timespec deadline;
+  int ret = 1;
+
+  if (threadControl == NULL) return 1;
+
+  thread_deadline(&deadline, timeout_msec);
+
+  pthread_mutex_lock(&threadControl->mutex);
+
+  while (threadControl->sem == THREAD_BLOCK && timeout_msec != 0)
+  {
+    if (timeout_msec < 0)
+      pthread_cond_wait(&threadControl->cond, &threadControl->mutex);
+    else if (pthread_cond_timedwait(&threadControl->cond, &threadControl->mutex, &deadline) == ETIMEDOUT)
+      break;
+  }
+
+  if (threadControl->sem == THREAD_BLOCK)
+    ret = -1;
+  else
+    threadControl->sem = THREAD_BLOCK;
+
+  pthread_mutex_unlock(&threadControl->mutex);
+
+  return ret;
+}
+
+static int
+context_thread_get_status(thread *threadControl)
+{
+  int status;
+
+  pthread_mutex_lock(&threadControl->mutex);
+
+  status = threadControl->status;
+
+  pthread_mutex_unlock(&threadControl->mutex);
+
+  return status;
+}
+
+static void
+context_thread_set_status(thread *threadControl, int status)
+{
+  pthread_mutex_lock(&threadControl->mutex);
+
+  threadControl->status = status;
+
+  pthread_cond_broadcast(&threadControl->cond);
+
+  pthread_mutex_unlock(&threadControl->mutex);
+}
+
+/**
+ * @brief Waits, up to a given timeout, for a paused thread to be continued
+ * (or stopped).
+ *
+ * @return thread status
+ */
+static int
+context_thread_wait_paused(thread *threadControl, int timeout_msec)
+{
+  struct timespec deadline;
+  int status;
+
+  thread_deadline(&deadline, timeout_msec);
+
+  pthread_mutex_lock(&threadControl->mutex);
+
+  while (threadControl->status == THREAD_STATUS_PAUSE && timeout_msec != 0)
+  {
+    if (timeout_msec < 0)
+      pthread_cond_wait(&threadControl->cond, &threadControl->mutex);
+    else if (pthread_cond_timedwait(&threadControl->cond, &threadControl->mutex, &deadline) == ETIMEDOUT)
+      break;
+  }
+
+  status = threadControl->status;
+
+  pthread_mutex_unlock(&threadControl->mutex);
+
+  return status;
+}
+
+static int
+context_thread_continue(thread *threadControl)
+{
+  int ret = 0;
+
+  if (threadControl != NULL && context_thread_sem_wait(threadControl, THREAD_SEM_TIMEOUT) == 1) {
+    if (context_thread_get_status(threadControl) == THREAD_STATUS_PAUSE) {
+      context_thread_set_status(threadControl, THREAD_STATUS_ALIVE);
+      ret = 1;
+    }
+    context_thread_sem_push(threadControl);
+  }
+
+  return ret;
+}
+
+static int
+context_thread_pause(thread *threadControl)
+{
+  int ret = 0;
+
+  if (threadControl != NULL && context_thread_sem_wait(threadControl, THREAD_SEM_TIMEOUT) == 1) {
+    if (context_thread_get_status(threadControl) == THREAD_STATUS_ALIVE) {
+      context_thread_set_status(threadControl, THREAD_STATUS_PAUSE);
+      ret = 1;
+    }
+    context_thread_sem_push(threadControl);
+  }
+
+  return ret;
+}
+
+/**
+ * @brief Internal ID of a named worker.
+ *
+ * @return worker ID or -1, when there's no such worker
+ */
+static int
+thread_worker_find(const char *name)
+{
+  int i;
+
+  for (i = 0; i < thread_registry_count; i++)
+  {
+    if (strncmp(thread_registry[i].name, name, THREAD_NAME_SIZE) == 0) return i;
+  }
+
+  return -1;
+}
+
+/**
+ * @brief Slot of a worker that is over (started, then stopped or dead, with
+ * no native thread left and no supervision), for a new name to take once the
+ * registry is full. The status bar and communication keep theirs. Must be
+ * called with @link thread_control_mutex @endlink held.
+ *
+ * @return worker ID or -1, when there's none
+ */
+static int
+thread_worker_reusable(void)
+{
+  threadWorker *worker;
+  int i, status;
+
+  for (i = THREAD_COMMUNICATION + 1; i < thread_registry_count; i++)
+  {
+    worker = &thread_registry[i];
+
+    if (!worker->ran || worker->code != NULL || worker->running > 0 || worker->attached) continue;
+
+    pthread_mutex_lock(&worker->control->mutex);
+
+    status = worker->control->status;
+
+    pthread_mutex_unlock(&worker->control->mutex);
+
+    if (status == THREAD_STATUS_DEAD) return i;
+  }
+
+  return -1;
+}
+
+/**
+ * @brief Registers a named worker, or finds it when it already exists. New
+ * workers are dead until started. A full registry hands out the slot of a
+ * worker that is over, whose ID then refers to the new one (its generation
+ * keeps counting, so a leftover thread of the old one stays detached). Must
+ * be called with @link thread_control_mutex @endlink held.
+ *
+ * @return worker ID or -1, when the registry is full or out of memory
+ */
+static int
+thread_worker_register(const char *name)
+{
+  threadWorker *worker;
+  int id = thread_worker_find(name);
+
+  if (id >= 0) return id;
+
+  if (thread_registry_count >= THREAD_MAX_COUNT)
+  {
+    id = thread_worker_reusable();
+
+    if (id < 0) return id;
+
+    worker = &thread_registry[id];
+
+    memset(worker->name, 0, sizeof(worker->name));
+    strncpy(worker->name, name, THREAD_NAME_SIZE - 1);
+
+    /* Not started yet: no queue, as a new worker */
+    pthread_mutex_lock(&command_exchange_mutex);
+
+    if (worker->queue)
+    {
+      thread_execution_clean(worker->queue);
+
+      free(worker->queue);
+
+      worker->queue = NULL;
+    }
+
+    pthread_mutex_unlock(&command_exchange_mutex);
+
+    worker->ran = 0;
+    worker->restarts = 0;
+    worker->backoff = 0;
+    worker->failed = 0;
+    worker->failure[0] = 0;
+
+    return id;
+  }
+
+  id = thread_registry_count;
+
+  worker = &thread_registry[id];
+
+  worker->control = context_thread_new(id, THREAD_STATUS_DEAD);
+
+  if (worker->control == NULL) return -1;
+
+  context_thread_sem_push(worker->control);
+
+  strncpy(worker->name, name, THREAD_NAME_SIZE - 1);
+
+  __sync_synchronize(); /* entry set before the count is seen */
+
+  thread_registry_count++;
+
+  return id;
+}
+
+static threadWorker *
+thread_worker_get(mrb_int id)
+{
+  if (id < 0 || id >= thread_registry_count) return NULL;
+
+  return &thread_registry[id];
+}
+
+static thread *
+thread_worker_control(mrb_int id)
+{
+  threadWorker *worker = thread_worker_get(id);
+
+  return (worker) ? worker->control : NULL;
+}
+
+/**
+ * @brief Command queue of a worker. Must be called with @link
+ * command_exchange_mutex @endlink held.
+ */
+static threadExecutionQueue *
+thread_worker_queue(mrb_int id)
+{
+  threadWorker *worker = thread_worker_get(id);
+
+  return (worker) ? worker->queue : NULL;
+}
+
+static void *
+thread_worker_run(void *arg)
+{
+  threadSpawn *spawn = (threadSpawn *) arg;
+  threadWorker *worker = thread_worker_get(spawn->id);
+  struct instance *current;
+  int ai;
+
+  current = context_instance_acquire(spawn->application);
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  if (worker->generation == spawn->generation) worker->current = current;
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  worker_self_id = spawn->id;
+  worker_self_generation = spawn->generation;
+
+  if (current != NULL)
+  {
+    context_instance_lock(current);
+
+    ai = mrb_gc_arena_save(context_instance_state(current));
+
+    context_instance_eval(current, spawn->code, spawn->len);
+
+    mrb_gc_arena_restore(context_instance_state(current), ai);
+
+    context_instance_unlock(current);
+  }
+
+  /* The snippet is over: the worker is dead, unless restarted meanwhile */
+  pthread_mutex_lock(&thread_control_mutex);
+
+  if (worker->current == current) worker->current = NULL;
+
+  if (worker->generation == spawn->generation)
+  {
+    context_thread_set_status(worker->control, THREAD_STATUS_DEAD);
+
+    worker->attached = 0;
+  }
+
+  worker->running--;
+
+  worker_self_id = -1;
+
+  pthread_cond_broadcast(&thread_exit_cond);
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  if (current != NULL) context_instance_release(current);
+
+  free(spawn);
+
+  return NULL;
+}
+
+/**
+ * @brief Runs a snippet on a native thread, in the worker's own instance
+ * ("thread_<name>"), as the communication thread does with mrb_eval. Must be
+ * called with @link thread_control_mutex @endlink held.
+ *
+ * @return 1 on success or 0, otherwise
+ */
+static int
+thread_worker_spawn(threadWorker *worker, int id, const char *code, size_t len)
+{
+  threadSpawn *spawn;
+  pthread_t handle;
+
+  spawn = (threadSpawn *) malloc(offsetof(threadSpawn, code) + len + 1);
+
+  if (spawn == NULL) return 0;
+
+  spawn->id = id;
+  spawn->generation = worker->generation + 1;
+  spawn->len = len;
+
+  snprintf(spawn->application, sizeof(spawn->application), "thread_%s", worker->name);
+
+  memcpy(spawn->code, code, len);
+  spawn->code[len] = 0;
+
+  if (pthread_create(&handle, NULL, thread_worker_run, spawn) != 0)
+  {
+    free(spawn);
+
+    return 0;
+  }
+
+  pthread_detach(handle);
+
+  worker->generation++;
+  worker->attached = 1;
+  worker->running++;
+
+  return 1;
+}
+
+/**
+ * @brief Keeps a snippet to restart the worker with. Must be called with
+ * @link thread_control_mutex @endlink held.
+ */
+static int
+thread_supervisor_watch(threadWorker *worker, const char *code, size_t len, int stall_msec)
+{
+  char *copy = (char *) malloc(len + 1);
+
+  if (copy == NULL) return 0;
+
+  memcpy(copy, code, len);
+  copy[len] = 0;
+
+  free(worker->code);
+
+  worker->code = copy;
+  worker->len = len;
+  worker->stall_msec = stall_msec;
+  worker->failed = 0;
+  worker->backoff = 0;
+  worker->heartbeat = thread_clock_msec();
+  worker->started = worker->heartbeat;
+
+  return 1;
+}
+
+static void
+thread_supervisor_unwatch(threadWorker *worker)
+{
+  free(worker->code);
+
+  worker->code = NULL;
+  worker->failed = 0;
+
+  pthread_cond_signal(&supervisor_cond); /* over, if it was the last one */
+}
+
+/**
+ * @brief Restarts a failed worker once its backoff is over or, for a healthy
+ * one, tells whether it died or stopped beating. A stalled worker can't be
+ * cancelled: it's left running, detached from its instance (retired, so the
+ * restart gets a fresh one) and from the worker (its generation is gone), and
+ * its next scheduler or channel call raises (@link thread_worker_check
+ * @endlink), ending its snippet.
+ * Must be called with @link thread_control_mutex @endlink held.
+ */
+static void
+thread_supervisor_check(threadWorker *worker, int id, unsigned long long now)
+{
+  const char *failure = NULL;
+  int status;
+
+  if (worker->code == NULL) return;
+
+  if (!worker->failed)
+  {
+    pthread_mutex_lock(&worker->control->mutex);
+
+    status = worker->control->status;
+
+    pthread_mutex_unlock(&worker->control->mutex);
+
+    if (status == THREAD_STATUS_DEAD)
+      failure = "exited";
+    else if (worker->stall_msec > 0 && status != THREAD_STATUS_PAUSE && now - worker->heartbeat > (unsigned long long) worker->stall_msec)
+      failure = "stalled";
+
+    if (failure == NULL)
+    {
+      if (now - worker->started > SUPERVISOR_BACKOFF_MAX) worker->backoff = 0;
+
+      return;
+    }
+
+    if (worker->current != NULL && status != THREAD_STATUS_DEAD)
+    {
+      context_instance_retire(worker->current);
+
+      worker->current = NULL;
+    }
+
+    worker->generation++;
+    worker->attached = 0;
+
+    pthread_cond_broadcast(&thread_exit_cond);
+
+    context_thread_set_status(worker->control, THREAD_STATUS_DEAD);
+
+    worker->backoff = (worker->backoff) ? worker->backoff * 2 : SUPERVISOR_BACKOFF_MIN;
+
+    if (worker->backoff > SUPERVISOR_BACKOFF_MAX) worker->backoff = SUPERVISOR_BACKOFF_MAX;
+
+    worker->restart_at = now + worker->backoff;
+    worker->failed = 1;
+
+    snprintf(worker->failure, sizeof(worker->failure), "%s", failure);
+
+    ContextLogFile("\nthread [%s] %s, restart in %llu ms", worker->name, failure, worker->backoff);
+  }
+
+  if (now < worker->restart_at) return;
+
+  worker->restarts++;
+  worker->failed = 0;
+  worker->heartbeat = now;
+  worker->started = now;
+
+  context_thread_reset(worker->control, id, THREAD_FREE);
+
+  context_thread_sem_push(worker->control);
+
+  if (!thread_worker_spawn(worker, id, worker->code, worker->len))
+  {
+    context_thread_set_status(worker->control, THREAD_STATUS_DEAD);
+
+    snprintf(worker->failure, sizeof(worker->failure), "spawn failed");
+  }
+}
+
+static void *
+thread_supervisor_run(void *arg)
+{
+  struct timespec deadline;
+  unsigned long long now;
+  int i, watched = 1;
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  /* Over once no worker is supervised (all stopped), see _stop */
+  while (watched)
+  {
+    thread_deadline(&deadline, SUPERVISOR_PERIOD);
+
+    pthread_cond_timedwait(&supervisor_cond, &thread_control_mutex, &deadline);
+
+    now = thread_clock_msec();
+
+    for (i = 0, watched = 0; i < thread_registry_count; i++)
+    {
+      thread_supervisor_check(&thread_registry[i], i, now);
+
+      if (thread_registry[i].code != NULL) watched = 1;
+    }
+  }
+
+  supervisor_started = 0;
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  return NULL;
+}
+
+/**
+ * @brief Starts the supervisor, on the first supervised spawn after it was
+ * over. Must be called with @link thread_control_mutex @endlink held.
+ */
+static void
+thread_supervisor_start(void)
+{
+  pthread_t handle;
+
+  if (supervisor_started) return;
+
+  if (pthread_create(&handle, NULL, thread_supervisor_run, NULL) == 0)
+  {
+    pthread_detach(handle);
+
+    supervisor_started = 1;
+  }
+}
+
+/**
+ * @brief Heartbeat of the worker the calling native thread runs, if any. A
+ * thread detached by the supervisor (stalled, then restarted) is told so,
+ * and its snippet must unwind rather than compete with its replacement.
+ *
+ * @return 1 or 0, when the calling thread has been detached
+ */
+static int
+thread_worker_beat(void)
+{
+  threadWorker *worker;
+  int attached = 1;
+
+  if (worker_self_id < 0) return 1;
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  worker = thread_worker_get(worker_self_id);
+
+  if (worker->generation == worker_self_generation)
+    worker->heartbeat = thread_clock_msec();
+  else
+    attached = 0;
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  return attached;
+}
+
+/**
+ * @brief Raises on a thread detached by the supervisor (no lock held), so the
+ * loop of its snippet ends at its next scheduler or channel call.
+ */
+static void
+thread_worker_check(mrb_state *mrb)
+{
+  if (!thread_worker_beat())
+  {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "worker thread detached by the supervisor");
+  }
+}
+
+static threadExecutionQueue *
+thread_execution_new(void)
+{
+  return (threadExecutionQueue *) calloc(1, sizeof(threadExecutionQueue));
+}
+
+static executionMessage *
+thread_execution_find(threadExecutionQueue *queue, int id)
+{
+  executionMessage *message;
+
+  if (queue == NULL) return NULL;
+
+  message = queue->index[(unsigned int) id % EXECUTION_BUCKETS];
+
+  while (message != NULL && message->id != id) message = message->bucket;
+
+  return message;
+}
+
+static executionMessage *
+thread_execution_message_new(threadExecutionQueue *queue, int id)
+{
+  executionMessage *message = (executionMessage *) calloc(1, sizeof(executionMessage));
+
+  if (message == NULL) return NULL;
+
+  message->id = id;
+  message->front = queue->last;
+  message->bucket = queue->index[(unsigned int) id % EXECUTION_BUCKETS];
+
+  if (queue->last != NULL)
+    queue->last->rear = message;
+  else
+    queue->first = message;
+
+  queue->last = message;
+  queue->index[(unsigned int) id % EXECUTION_BUCKETS] = message;
+  queue->size++;
+
+  return message;
+}
+
+/**
+ * @brief Copies a payload to a message buffer, growing it only when it's too
+ * small.
+ *
+ * @return 1 on success or 0, when out of memory
+ */
+static int
+thread_execution_store(char **buf, int *size, const char *src, int len)
+{
+  char *grown;
+
+  if (len > *size)
+  {
+    grown = (char *) realloc(*buf, len);
+
+    if (grown == NULL) return 0;
+
+    *buf = grown;
+    *size = len;
+  }
+
+  memcpy(*buf, src, len);
+
+  return 1;
+}
+
+static int
+thread_execution_enqueue(threadExecutionQueue *queue, int id, int command, char *buf, int len)
+{
+  executionMessage *message;
+
+  if (queue == NULL || len < 0) return 0;
+
+  message = thread_execution_find(queue, id);
+
+  if (message == NULL) message = thread_execution_message_new(queue, id);
+
+  if (message == NULL) return 0;
+
+  /* Copy command/response to message */
+  if (command == 0) {
+    if (!thread_execution_store(&message->command, &message->commandSize, buf, len)) return 0;
+    message->commandLen = len;
+    message->executed = 0;
+  } else {
+    if (!thread_execution_store(&message->response, &message->responseSize, buf, len)) return 0;
+    message->responseLen = len;
+    message->executed = 1;
+    message->responses++;
+
+    pthread_cond_broadcast(&command_exchange_cond);
+  }
+
+  return len;
+}
+
+/**
+ * @brief Consumes the command (0) or response (1) pending for a given ID.
+ * The message and its buffers are kept for the next exchange.
+ *
+ * @return consumed length or 0, when there was none
+ */
+static int
+thread_execution_dequeue(threadExecutionQueue *queue, int id, int command, char *buf)
+{
+  int len = 0;
+  executionMessage *message = thread_execution_find(queue, id);
+
+  if (message == NULL) return len;
+
+  if (command == 0 && message->commandLen > 0 && message->executed == 0) {
+    if (buf) memcpy(buf, message->command, message->commandLen);
+    len = message->commandLen;
+    message->commandLen = 0;
+  } else if (command == 1 && message->responseLen > 0 && message->executed == 1) {
+    if (buf) memcpy(buf, message->response, message->responseLen);
+    len = message->responseLen;
+    message->responseLen = 0;
+  }
+
+  return len;
+}
+
+/**
+ * @brief Takes a message out of the queue, releasing it.
+ */
+static void
+thread_execution_remove(threadExecutionQueue *queue, int id)
+{
+  executionMessage *message, **link;
+
+  if (queue == NULL) return;
+
+  link = &queue->index[(unsigned int) id % EXECUTION_BUCKETS];
+
+  while (*link != NULL && (*link)->id != id) link = &(*link)->bucket;
+
+  if ((message = *link) == NULL) return;
+
+  *link = message->bucket;
+
+  if (message->front != NULL)
+    message->front->rear = message->rear;
+  else
+    queue->first = message->rear;
+
+  if (message->rear != NULL)
+    message->rear->front = message->front;
+  else
+    queue->last = message->front;
+
+  queue->size--;
+
+  free(message->command);
+  free(message->response);
+  free(message);
+}
+
+/**
+ * @brief Queues a binary command under a new call ID.
+ *
+ * @return call ID or 0, when out of memory
+ */
+static int
+thread_execution_call(threadExecutionQueue *queue, int opcode, char *buf, int len)
+{
+  executionMessage *message;
+  int id;
+
+  if (queue == NULL) return 0;
+
+  do
+  {
+    id = __sync_add_and_fetch(&command_call_id, 1) & 0x3fffffff;
+  } while (id == 0 || thread_execution_find(queue, id) != NULL);
+
+  message = thread_execution_message_new(queue, id);
+
+  if (message == NULL) return 0;
+
+  message->opcode = opcode;
+
+  if (!thread_execution_enqueue(queue, id, 0, buf, len) && len > 0)
+  {
+    thread_execution_remove(queue, id);
+
+    return 0;
+  }
+
+  return id;
+}
+
+/**
+ * @brief Copies the commands pending in a queue, so they can be run without
+ * the lock (running them allocates, which may raise). Must be called with
+ * @link command_exchange_mutex @endlink held.
+ *
+ * @param queue given queue
+ * @param id command ID, 0 for any
+ * @param opcode binary command opcode, 0 for any
+ * @param count number of copies
+ *
+ * @return copies, released by @link thread_execution_pending @endlink
+ */
+static executionMessage *
+thread_execution_snapshot(threadExecutionQueue *queue, int id, int opcode, int *count)
+{
+  executionMessage *local, *snapshot;
+  int size = 0;
+
+  *count = 0;
+
+  for (local = (queue) ? queue->first : NULL; local != NULL; local = local->rear)
+  {
+    if (local->executed == 0 && local->commandLen > 0 && (id == 0 || local->id == id) && (opcode == 0 || local->opcode == opcode)) size++;
+  }
+
+  if (size == 0 || (snapshot = (executionMessage *) malloc(sizeof(executionMessage) * size)) == NULL) return NULL;
+
+  for (local = queue->first; local != NULL && *count < size; local = local->rear)
+  {
+    if (local->executed == 0 && local->commandLen > 0 && (id == 0 || local->id == id) && (opcode == 0 || local->opcode == opcode))
+    {
+      snapshot[*count].id = local->id;
+      snapshot[*count].opcode = local->opcode;
+      snapshot[*count].commandLen = local->commandLen;
+      snapshot[*count].command = (char *) malloc(local->commandLen);
+
+      if (snapshot[*count].command == NULL) continue;
+
+      memcpy(snapshot[*count].command, local->command, local->commandLen);
+
+      (*count)++;
+    }
+  }
+
+  return snapshot;
+}
+
+/**
+ * @brief Flat array of snapshot commands: ID, opcode and command, for each
+ * one. Releases the snapshot.
+ */
+static mrb_value
+thread_execution_pending(mrb_state *mrb, executionMessage *snapshot, int count)
+{
+  mrb_value pending;
+  int i;
+
+  pending = mrb_ary_new_capa(mrb, count * 3);
+
+  for (i = 0; i < count; i++)
+  {
+    mrb_ary_push(mrb, pending, mrb_fixnum_value(snapshot[i].id));
+    mrb_ary_push(mrb, pending, mrb_fixnum_value(snapshot[i].opcode));
+    mrb_ary_push(mrb, pending, mrb_str_new(mrb, snapshot[i].command, snapshot[i].commandLen));
+
+    free(snapshot[i].command);
+    snapshot[i].command = NULL;
+  }
+
+  free(snapshot);
+
+  return pending;
+}
+
+/**
+ * @brief Takes the response pending for a given ID out of its message, which
+ * gets a new buffer for the next one, so the string is created once
+ * @link command_exchange_mutex @endlink (held) is released without copying
+ * the payload twice.
+ *
+ * @return malloc'd buffer (and its length) or NULL, when there's none
+ */
+static char *
+thread_execution_take(threadExecutionQueue *queue, int id, int *len)
+{
+  executionMessage *message = thread_execution_find(queue, id);
+  char *response;
+
+  *len = 0;
+
+  if (message == NULL || message->responseLen <= 0 || message->executed != 1) return NULL;
+
+  response = message->response;
+  *len = message->responseLen;
+
+  message->response = NULL;
+  message->responseSize = 0;
+  message->responseLen = 0;
+
+  return response;
+}
+
+/**
+ * @brief String of a response taken from the queue, released, or "cache"
+ * when there was none.
+ */
+static mrb_value
+thread_execution_response_str(mrb_state *mrb, char *response, int len)
+{
+  mrb_value str;
+
+  if (response == NULL) return mrb_str_new(mrb, "cache", 5);
+
+  str = mrb_str_new(mrb, response, len);
+
+  free(response);
+
+  return str;
+}
+
+static void
+thread_execution_clean(threadExecutionQueue *queue)
+{
+  executionMessage *message, *next;
+
+  if (queue == NULL) return;
+
+  for (message = queue->first; message != NULL; message = next)
+  {
+    next = message->rear;
+
+    free(message->command);
+    free(message->response);
+    free(message);
+  }
+
+  memset(queue, 0, sizeof(threadExecutionQueue));
+}
+
+/**************************/
+/* Externalized functions */
+/**************************/
+
+static mrb_value
+mrb_thread_channel_s__read(mrb_state *mrb, mrb_value self)
+{
+  mrb_int id = 0, channel = 0, event = 0;
+  int event_id;
+  threadChannel *current;
+  message *node = NULL;
+  mrb_value array;
+
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "iii", &id, &channel, &event);
+
+  thread_worker_check(mrb);
+
+  TRACE("channel [%d], event [%d]", channel, event);
+
+  event_id = event;
+
+  current = thread_channel_get(channel);
+
+  if (current)
+  {
+    pthread_mutex_lock(&current->mutex);
+
+    if (current->shared)
+      node = thread_channel_shift_shared(current);
+    else
+      node = thread_channel_dequeue(current, &event_id);
+
+    pthread_mutex_unlock(&current->mutex);
+  }
+
+  array = mrb_ary_new(mrb);
+  if (node) {
+    mrb_ary_push(mrb, array, mrb_fixnum_value(node->id));
+    mrb_ary_push(mrb, array, message_to_str(mrb, node));
   } else {
-    message = thread_execution_message_new(id);
-    if (queue->size == 0) {
-      queue->first = message;
-      queue->last = message;
-      queue->size = 1;
-    } else {
-      queue->last->rear = message;
-      message->front = queue->last;
-      queue->last = message;
-      queue->size++;
+    mrb_ary_push(mrb, array, mrb_fixnum_value(event_id));
+  }
+
+  TRACE("return");
+
+  return array;
+}
+
+static mrb_value
+mrb_thread_channel_s__write(mrb_state *mrb, mrb_value self)
+{
+  mrb_int id = 0, channel = 0, event = 0, len = 0;
+  threadChannel *current;
+  message *node;
+  mrb_value value;
+
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "iiiS", &id, &channel, &event, &value);
+
+  thread_worker_check(mrb);
+
+  TRACE("channel [%d], event [%d]", channel, event);
+
+  current = thread_channel_get(channel);
+
+  if (current && current->shared)
+  {
+    pthread_mutex_lock(&current->mutex);
+
+    len = context_shm_ring_write(current->shared, event, RSTRING_PTR(value), RSTRING_LEN(value));
+
+    pthread_mutex_unlock(&current->mutex);
+
+    return mrb_fixnum_value(len);
+  }
+
+  node = (current) ? message_new(event, RSTRING_PTR(value), RSTRING_LEN(value)) : NULL;
+
+  if (node)
+  {
+    pthread_mutex_lock(&current->mutex);
+
+    len = thread_channel_push(current, node) ? node->len : 0;
+
+    pthread_mutex_unlock(&current->mutex);
+
+    if (len == 0) message_free(node);
+  }
+
+  TRACE("return");
+
+  return mrb_fixnum_value(len);
+}
+
+/**
+ * @brief Dequeues up to a given number of messages, from the oldest to the
+ * newest one, under a single lock acquisition.
+ *
+ * @return array of [event ID, payload] pairs
+ */
+static mrb_value
+mrb_thread_channel_s__drain(mrb_state *mrb, mrb_value self)
+{
+  mrb_int channel = 0, max = 0;
+  threadChannel *current;
+  message *first = NULL, *last = NULL, *node;
+  mrb_value array, pair;
+  int ai;
+
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "ii", &channel, &max);
+
+  thread_worker_check(mrb);
+
+  current = thread_channel_get(channel);
+
+  if (current)
+  {
+    pthread_mutex_lock(&current->mutex);
+
+    while (max-- > 0 && (node = (current->shared) ? thread_channel_shift_shared(current) : thread_channel_shift(current)) != NULL)
+    {
+      if (last) last->next = node; else first = node;
+
+      last = node;
+    }
+
+    pthread_mutex_unlock(&current->mutex);
+  }
+
+  array = mrb_ary_new(mrb);
+
+  ai = mrb_gc_arena_save(mrb);
+
+  while (first != NULL)
+  {
+    node = first;
+    first = node->next;
+
+    pair = mrb_ary_new_capa(mrb, 2);
+    mrb_ary_push(mrb, pair, mrb_fixnum_value(node->id));
+    mrb_ary_push(mrb, pair, message_to_str(mrb, node));
+    mrb_ary_push(mrb, array, pair);
+
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  TRACE("return");
+
+  return array;
+}
+
+/**
+ * @brief Enqueues every payload of an array, with the same event ID, under a
+ * single lock acquisition. Payloads are queued in order, stopping at the
+ * first one that doesn't fit.
+ *
+ * @return number of queued payloads
+ */
+static mrb_value
+mrb_thread_channel_s__write_batch(mrb_state *mrb, mrb_value self)
+{
+  mrb_int channel = 0, event = 0, i, count = 0, written = 0;
+  threadChannel *current;
+  message **nodes;
+  mrb_value payloads, payload;
+
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "iiA", &channel, &event, &payloads);
+
+  thread_worker_check(mrb);
+
+  current = thread_channel_get(channel);
+
+  if (!current || RARRAY_LEN(payloads) == 0) return mrb_fixnum_value(0);
+
+  for (i = 0; i < RARRAY_LEN(payloads); i++)
+  {
+    if (!mrb_string_p(RARRAY_PTR(payloads)[i]))
+    {
+      mrb_raise(mrb, E_TYPE_ERROR, "payloads must be strings");
+    }
+  }
+
+  if (current->shared)
+  {
+    pthread_mutex_lock(&current->mutex);
+
+    while (written < RARRAY_LEN(payloads))
+    {
+      payload = RARRAY_PTR(payloads)[written];
+
+      if (!context_shm_ring_write(current->shared, event, RSTRING_PTR(payload), RSTRING_LEN(payload))) break;
+
+      written++;
+    }
+
+    pthread_mutex_unlock(&current->mutex);
+
+    return mrb_fixnum_value(written);
+  }
+
+  nodes = (message **) mrb_malloc(mrb, RARRAY_LEN(payloads) * sizeof(message *));
+
+  for (i = 0; i < RARRAY_LEN(payloads); i++)
+  {
+    payload = RARRAY_PTR(payloads)[i];
+
+    nodes[count] = message_new(event, RSTRING_PTR(payload), RSTRING_LEN(payload));
+
+    if (nodes[count] == NULL) break;
+
+    count++;
+  }
+
+  pthread_mutex_lock(&current->mutex);
+
+  while (written < count && thread_channel_push(current, nodes[written])) written++;
+
+  pthread_mutex_unlock(&current->mutex);
+
+  for (i = written; i < count; i++) message_free(nodes[i]);
+
+  mrb_free(mrb, nodes);
+
+  TRACE("return");
+
+  return mrb_fixnum_value(written);
+}
+
+static mrb_value
+mrb_thread_channel_s__create(mrb_state *mrb, mrb_value self)
+{
+  mrb_int capacity = QUEUE_MAX_SIZE;
+  mrb_value name;
+  int id;
+
+  mrb_get_args(mrb, "S|i", &name, &capacity);
+
+  if (RSTRING_LEN(name) <= 0 || RSTRING_LEN(name) >= CHANNEL_NAME_SIZE)
+  {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid channel name size (1 to %S)", mrb_fixnum_value(CHANNEL_NAME_SIZE - 1));
+  }
+
+  if (capacity <= 0 || capacity > QUEUE_MAX_SIZE * 64)
+  {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid channel capacity (1 to %S)", mrb_fixnum_value(QUEUE_MAX_SIZE * 64));
+  }
+
+  id = thread_channel_create(mrb_string_value_cstr(mrb, &name), capacity, NULL);
+
+  if (id < 0)
+  {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "could not create channel");
+  }
+
+  return mrb_fixnum_value(id);
+}
+
+static mrb_value
+mrb_thread_channel_s__create_shared(mrb_state *mrb, mrb_value self)
+{
+  mrb_int size = 65536;
+  mrb_value name, path;
+  int id;
+
+  mrb_get_args(mrb, "SS|i", &name, &path, &size);
+
+  if (RSTRING_LEN(name) <= 0 || RSTRING_LEN(name) >= CHANNEL_NAME_SIZE)
+  {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid channel name size (1 to %S)", mrb_fixnum_value(CHANNEL_NAME_SIZE - 1));
+  }
+
+  if (size <= 0)
+  {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid shared channel size");
+  }
+
+  id = thread_channel_create(mrb_string_value_cstr(mrb, &name), size, mrb_string_value_cstr(mrb, &path));
+
+  if (id < 0)
+  {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "could not create shared channel");
+  }
+
+  return mrb_fixnum_value(id);
+}
+
+/**
+ * @brief Waits for a message to be available on a given channel.
+ *
+ * @return true when there's a message to read or false, on timeout
+ */
+static mrb_value
+mrb_thread_channel_s__wait(mrb_state *mrb, mrb_value self)
+{
+  mrb_int channel = 0, timeout = -1;
+  threadChannel *current;
+  struct timespec deadline;
+  int ready;
+
+  mrb_get_args(mrb, "i|i", &channel, &timeout);
+
+  thread_worker_check(mrb);
+
+  current = thread_channel_get(channel);
+
+  if (current == NULL) return mrb_false_value();
+
+  if (current->shared) return mrb_bool_value(context_shm_ring_wait(current->shared, timeout));
+
+  thread_deadline(&deadline, timeout);
+
+  pthread_mutex_lock(&current->mutex);
+
+  while (current->live == 0 && timeout != 0)
+  {
+    if (timeout < 0)
+      pthread_cond_wait(&current->cond, &current->mutex);
+    else if (pthread_cond_timedwait(&current->cond, &current->mutex, &deadline) == ETIMEDOUT)
+      break;
+  }
+
+  ready = (current->live > 0);
+
+  pthread_mutex_unlock(&current->mutex);
+
+  return mrb_bool_value(ready);
+}
+
+static mrb_value
+mrb_thread_channel_s__find(mrb_state *mrb, mrb_value self)
+{
+  mrb_value name;
+  int id;
+
+  mrb_get_args(mrb, "S", &name);
+
+  pthread_mutex_lock(&channel_registry_mutex);
+
+  id = thread_channel_find(mrb_string_value_cstr(mrb, &name));
+
+  pthread_mutex_unlock(&channel_registry_mutex);
+
+  return (id < 0) ? mrb_nil_value() : mrb_fixnum_value(id);
+}
+
+/**
+ * @brief Event IDs for ThreadChannel messages. Shared by every instance and
+ * monotonic (positive, skipping 0, wrapping only after 2^31 IDs).
+ */
+static mrb_value
+mrb_thread_channel_s__generate_id(mrb_state *mrb, mrb_value self)
+{
+  int id;
+
+  do
+  {
+    id = __sync_add_and_fetch(&channel_event_id, 1) & 0x7FFFFFFF;
+  } while (id == 0);
+
+  return mrb_fixnum_value(id);
+}
+
+static mrb_value
+mrb_thread_scheduler_s__check(mrb_state *mrb, mrb_value self)
+{
+  mrb_int status = THREAD_STATUS_DEAD, id = 0, ret = 1, timeout = 0;
+  thread *threadControl = NULL;
+
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "i|i", &id, &timeout);
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  threadControl = thread_worker_control(id);
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  /* Waits without the control lock: the other threads keep going */
+  if (threadControl) {
+    ret = context_thread_sem_wait(threadControl, timeout);
+    if (ret == 1) {
+      status = context_thread_get_status(threadControl);
+      context_thread_sem_push(threadControl);
+    }
+    if (status == THREAD_STATUS_PAUSE && timeout != 0) {
+      status = context_thread_wait_paused(threadControl, timeout);
     }
   }
 
-  /* Copy command/response to message */
-  if (command == 0) {
-    message->command = (char *) realloc(message->command, len);
-    memcpy(message->command, buf, len);
-    message->commandLen = len;
-    message->executed = 0;
-  } else {
-    message->response = (char *) realloc(message->response, len);
-    memcpy(message->response, buf, len);
-    message->responseLen = len;
-    message->executed = 1;
-  }
+  TRACE("return");
 
-  return len;
+  return mrb_fixnum_value((ret == -1) ? THREAD_STATUS_BLOCK : status);
 }
 
-static int
-thread_execution_dequeue(threadExecutionQueue *queue, int id, int command, char *buf)
+static mrb_value
+mrb_thread_scheduler_s__continue(mrb_state *mrb, mrb_value self)
 {
-  int len = 0;
-  executionMessage *message = NULL;
-  executionMessage *local = NULL;
-
-  /* Search for already schedule execution */
-  if (queue && queue->size > 0) {
-    local = queue->first;
-    while (local != NULL) {
-      if (local->id == id) {
-        message = local;
-        break;
+  mrb_int id = 0, ret = 0;
+  thread *threadControl;
+
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "i", &id);
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  threadControl = thread_worker_control(id);
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  ret = context_thread_continue(threadControl);
+
+  TRACE("return");
+
+  return mrb_bool_value(ret == 1);
+}
+
+static mrb_value
+mrb_thread_scheduler_s__pause(mrb_state *mrb, mrb_value self)
+{
+  mrb_int id = 0, pause = 0;
+  thread *threadControl;
+
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "i", &id);
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  threadControl = thread_worker_control(id);
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  pause = context_thread_pause(threadControl);
+
+  TRACE("return");
+
+  return mrb_bool_value(pause == 1);
+}
+
+static mrb_value
+mrb_thread_scheduler_s__start(mrb_state *mrb, mrb_value self)
+{
+  mrb_int id = 0;
+  threadWorker *worker;
+
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "i", &id);
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  worker = thread_worker_get(id);
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  if (worker != NULL) {
+    /* Waits without the control lock, as _check does (controls are never
+     * released): lookups and the supervisor keep going */
+    context_thread_sem_wait(worker->control, THREAD_SEM_TIMEOUT);
+
+    pthread_mutex_lock(&thread_control_mutex);
+
+    if (id == THREAD_COMMUNICATION) {
+      thread_channel_reset(CHANNEL_SEND);
+
+      thread_channel_reset(CHANNEL_RECV);
+    }
+
+    pthread_mutex_lock(&command_exchange_mutex);
+
+    if (worker->queue)
+    {
+      thread_execution_clean(worker->queue);
+
+      free(worker->queue);
+    }
+
+    worker->queue = thread_execution_new();
+
+    if (id == THREAD_COMMUNICATION)
+    {
+      if (opcodeQueue)
+      {
+        thread_execution_clean(opcodeQueue);
+
+        free(opcodeQueue);
       }
-      local = local->rear;
+
+      opcodeQueue = thread_execution_new();
     }
-  }
-  if (message == NULL) return len;
 
-  /* Get information inside of struct synchronizing */
-  if (command == 0 && message && message->commandLen > 0 && message->executed == 0 && message->command) {
-    memcpy(buf, message->command, message->commandLen);
-    len = message->commandLen;
+    pthread_mutex_unlock(&command_exchange_mutex);
 
-    free(message->command);
-    message->executed = 0;
-    message->command = NULL;
-    message->commandLen = 0;
-  } else if (command == 1 && message && message->responseLen > 0 && message->executed == 1 && message->response) {
-    memcpy(buf, message->response, message->responseLen);
-    len = message->responseLen;
-    message->executed = 1;
-    free(message->response);
-    message->response = NULL;
-    message->responseLen = 0;
+    context_thread_reset(worker->control, id, THREAD_FREE);
+
+    context_thread_sem_push(worker->control);
+
+    worker->ran = 1;
+
+    pthread_mutex_unlock(&thread_control_mutex);
   }
 
-  if (message && message->command == NULL && message->response == NULL) {
-    if (message->front == NULL)
-      queue->first = message->rear;
-    else
-      if (message->rear != NULL) message->rear->front = NULL;
+  TRACE("return");
 
-    if (message->rear == NULL)
-      queue->last = message->front;
-    else
-      if (message->front != NULL) message->front->rear = NULL;
+  return mrb_bool_value(worker != NULL);
+}
 
-    queue->size--;
-    free(message);
+static mrb_value
+mrb_thread_scheduler_s__stop(mrb_state *mrb, mrb_value self)
+{
+  mrb_int id = 0;
+  thread *threadControl;
+
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "i", &id);
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  threadControl = thread_worker_control(id);
+
+  if (threadControl) thread_supervisor_unwatch(thread_worker_get(id));
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  if (threadControl) {
+    /* Waits without the control lock, as _start does */
+    context_thread_sem_wait(threadControl, THREAD_SEM_TIMEOUT);
+
+    pthread_mutex_lock(&thread_control_mutex);
+
+    context_thread_set_status(threadControl, THREAD_STATUS_DEAD);
+
+    if (id == THREAD_COMMUNICATION) {
+      thread_channel_reset(CHANNEL_SEND);
+
+      thread_channel_reset(CHANNEL_RECV);
+
+      thread_pub_sub_reset();
+    }
+
+    context_thread_sem_push(threadControl);
+
+    pthread_mutex_unlock(&thread_control_mutex);
   }
 
-  return len;
+  TRACE("return");
+
+  return mrb_true_value();
 }
 
-static void
-thread_execution_clean(threadExecutionQueue *queue)
+/**
+ * @brief Registers a named worker (dead until started).
+ *
+ * @return worker ID or -1, when the registry is full
+ */
+static mrb_value
+mrb_thread_scheduler_s__register(mrb_state *mrb, mrb_value self)
 {
-  char trash[CHANNEL_MAX_SIZE] = {0x00};
-  int len = 1, id = 0;
+  mrb_value name;
+  int id;
 
-  while (len != 0) {
-    id = 0;
-    memset(trash, 0, sizeof(trash));
-    len = thread_execution_dequeue(queue, id, 0, trash);
-    memset(trash, 0, sizeof(trash));
-    if (len > 0) thread_execution_dequeue(queue, id, 1, trash);
+  TRACE_FUNCTION();
+
+  mrb_get_args(mrb, "S", &name);
+
+  if (RSTRING_LEN(name) <= 0 || RSTRING_LEN(name) >= THREAD_NAME_SIZE)
+  {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid thread name size (1 to %S)", mrb_fixnum_value(THREAD_NAME_SIZE - 1));
   }
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  id = thread_worker_register(mrb_string_value_cstr(mrb, &name));
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  TRACE("return");
+
+  return mrb_fixnum_value(id);
 }
 
-/**************************/
-/* Externalized functions */
-/**************************/
+static mrb_value
+mrb_thread_scheduler_s__find(mrb_state *mrb, mrb_value self)
+{
+  mrb_value name;
+  int id;
+
+  mrb_get_args(mrb, "S", &name);
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  id = thread_worker_find(mrb_string_value_cstr(mrb, &name));
+
+  pthread_mutex_unlock(&thread_control_mutex);
 
+  return mrb_fixnum_value(id);
+}
+
+/**
+ * @brief Names of the registered workers, by internal ID.
+ */
 static mrb_value
-mrb_thread_channel_s__read(mrb_state *mrb, mrb_value self)
+mrb_thread_scheduler_s__workers(mrb_state *mrb, mrb_value self)
 {
-  mrb_int id = 0, len = 0, channel = 0, event = 0;
-  char buf[CHANNEL_MAX_SIZE] = {0x00};
-  mrb_value array;
+  mrb_value workers = mrb_ary_new(mrb);
+  int i;
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  for (i = 0; i < thread_registry_count; i++)
+  {
+    mrb_ary_push(mrb, workers, mrb_str_new_cstr(mrb, thread_registry[i].name));
+  }
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  return workers;
+}
+
+/**
+ * @brief Runs a snippet on a new native thread, in the worker's own
+ * instance. The worker must have been started (_start) and can't be already
+ * running one (its previous snippet must be over). From then on, until
+ * stopped, the supervisor runs the snippet again whenever it's over or, given
+ * stall_msec, when the worker doesn't beat (_heartbeat) for that long.
+ */
+static mrb_value
+mrb_thread_scheduler_s__spawn(mrb_state *mrb, mrb_value self)
+{
+  mrb_int id = 0, stall = 0;
+  mrb_value code;
+  threadWorker *worker;
+  int ret = 0;
 
   TRACE_FUNCTION();
 
-  pthread_mutex_lock(&message_exchange_mutex);
+  mrb_get_args(mrb, "iS|i", &id, &code, &stall);
 
-  mrb_get_args(mrb, "iii", &id, &channel, &event);
+  pthread_mutex_lock(&thread_control_mutex);
 
-  TRACE("channel [%d], event [%d]", channel, event);
+  worker = thread_worker_get(id);
 
-  if (channel == 0) {
-    len = thread_channel_dequeue(message_send_queue, &event, buf);
-  } else {
-    len = thread_channel_dequeue(message_recv_queue, &event, buf);
-  }
+  if (worker != NULL && !worker->attached && thread_supervisor_watch(worker, RSTRING_PTR(code), RSTRING_LEN(code), (stall > 0) ? stall : 0))
+  {
+    ret = thread_worker_spawn(worker, id, worker->code, worker->len);
 
-  array = mrb_ary_new(mrb);
-  mrb_ary_push(mrb, array, mrb_fixnum_value(event));
-  if (len > 0) {
-    mrb_ary_push(mrb, array, mrb_str_new(mrb, buf, len));
+    thread_supervisor_start();
   }
 
+  pthread_mutex_unlock(&thread_control_mutex);
+
   TRACE("return");
 
-  pthread_mutex_unlock(&message_exchange_mutex);
+  return mrb_bool_value(ret);
+}
 
-  return array;
+static mrb_value
+mrb_thread_scheduler_s__heartbeat(mrb_state *mrb, mrb_value self)
+{
+  mrb_int id = 0;
+  threadWorker *worker;
+
+  mrb_get_args(mrb, "i", &id);
+
+  thread_worker_check(mrb);
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  worker = thread_worker_get(id);
+
+  if (worker != NULL) worker->heartbeat = thread_clock_msec();
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  return mrb_bool_value(worker != NULL);
 }
 
+/**
+ * @brief Waits for the native thread of a worker to return. Threads detached
+ * by the supervisor aren't waited for: they end on their own, at their next
+ * scheduler or channel call.
+ *
+ * @param timeout milliseconds, negative to wait forever (default)
+ *
+ * @return true when it's over or false, on timeout
+ */
 static mrb_value
-mrb_thread_channel_s__write(mrb_state *mrb, mrb_value self)
+mrb_thread_scheduler_s__join(mrb_state *mrb, mrb_value self)
 {
-  mrb_int id = 0, channel = 0, event = 0, len = 0;
-  mrb_value value;
-  mrb_value return_value;
+  mrb_int id = 0, timeout = -1;
+  struct timespec deadline;
+  threadWorker *worker;
+  int ret;
+
+  mrb_get_args(mrb, "i|i", &id, &timeout);
+
+  thread_deadline(&deadline, timeout);
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  worker = thread_worker_get(id);
+
+  while (worker != NULL && worker->attached && timeout != 0)
+  {
+    if (timeout < 0)
+      pthread_cond_wait(&thread_exit_cond, &thread_control_mutex);
+    else if (pthread_cond_timedwait(&thread_exit_cond, &thread_control_mutex, &deadline) == ETIMEDOUT)
+      break;
+  }
+
+  ret = (worker == NULL || !worker->attached);
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  return mrb_bool_value(ret);
+}
+
+/**
+ * @brief Supervision figures of a worker, nil when it doesn't exist.
+ */
+static mrb_value
+mrb_thread_scheduler_s__supervisor_stats(mrb_state *mrb, mrb_value self)
+{
+  mrb_int id = 0;
+  threadWorker *worker, copy;
+  unsigned long long now = thread_clock_msec();
+  mrb_value hash;
+
+  mrb_get_args(mrb, "i", &id);
+
+  pthread_mutex_lock(&thread_control_mutex);
+
+  worker = thread_worker_get(id);
+
+  if (worker != NULL) copy = *worker;
+
+  pthread_mutex_unlock(&thread_control_mutex);
+
+  if (worker == NULL) return mrb_nil_value();
+
+  hash = mrb_hash_new(mrb);
+
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "supervised")), mrb_bool_value(copy.code != NULL));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "running")), mrb_fixnum_value(copy.running));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "restarts")), mrb_fixnum_value(copy.restarts));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "generation")), mrb_fixnum_value(copy.generation));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "failure")), (copy.failure[0]) ? mrb_str_new_cstr(mrb, copy.failure) : mrb_nil_value());
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "heartbeat_age")), mrb_fixnum_value((copy.code != NULL) ? (mrb_int) (now - copy.heartbeat) : -1));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "backoff")), mrb_fixnum_value(copy.backoff));
+
+  return hash;
+}
+
+static mrb_value
+mrb_thread_scheduler_s__command(mrb_state *mrb, mrb_value self)
+{
+  mrb_value command;
+  char *response;
+  mrb_int id = 0, thread = THREAD_COMMUNICATION;
+  threadExecutionQueue *queue;
+  int len = 0;
 
   TRACE_FUNCTION();
 
-  pthread_mutex_lock(&message_exchange_mutex);
+  mrb_get_args(mrb, "iS|i", &id, &command, &thread);
 
-  mrb_get_args(mrb, "iiiS", &id, &channel, &event, &value);
+  thread_worker_check(mrb);
+
+  pthread_mutex_lock(&command_exchange_mutex);
+
+  queue = thread_worker_queue(thread);
 
-  TRACE("channel [%d], event [%d]", channel, event);
+  response = thread_execution_take(queue, id, &len);
 
-  if (channel == 0)
-    len = thread_channel_enqueue(message_send_queue, event, RSTRING_PTR(value), RSTRING_LEN(value));
-  else
-    len = thread_channel_enqueue(message_recv_queue, event, RSTRING_PTR(value), RSTRING_LEN(value));
+  thread_execution_enqueue(queue, id, 0, RSTRING_PTR(command), RSTRING_LEN(command));
 
-  return_value = mrb_fixnum_value(len);
+  pthread_mutex_unlock(&command_exchange_mutex);
 
   TRACE("return");
 
-  pthread_mutex_unlock(&message_exchange_mutex);
-
-  return return_value;
+  return thread_execution_response_str(mrb, response, len);
 }
 
 static mrb_value
-mrb_thread_pub_sub_s__listen(mrb_state *mrb, mrb_value self)
+mrb_thread_scheduler_s__command_once(mrb_state *mrb, mrb_value self)
 {
-  mrb_int id = 0, len = 0;
-  char buf[CHANNEL_MAX_SIZE] = {0x00};
-  mrb_value return_value;
+  mrb_value command;
+  char *response;
+  mrb_int id = 0, thread = THREAD_COMMUNICATION;
+  threadExecutionQueue *queue;
+  int len = 0;
 
   TRACE_FUNCTION();
 
-  pthread_mutex_lock(&message_exchange_mutex);
+  mrb_get_args(mrb, "iS|i", &id, &command, &thread);
 
-  mrb_get_args(mrb, "i", &id);
+  thread_worker_check(mrb);
 
-  memset(buf, 0, sizeof(buf));
+  pthread_mutex_lock(&command_exchange_mutex);
 
-  len = pubsub_listen(id, buf);
+  queue = thread_worker_queue(thread);
 
-  if (len > 0)
-    return_value = mrb_str_new(mrb, buf, len);
-  else
-    return_value = mrb_nil_value();
+  response = thread_execution_take(queue, id, &len);
 
-  TRACE("return");
+  if (response != NULL) {
+    thread_execution_dequeue(queue, id, 0, NULL);
+  } else {
+    thread_execution_enqueue(queue, id, 0, RSTRING_PTR(command), RSTRING_LEN(command));
+  }
 
-  pthread_mutex_unlock(&message_exchange_mutex);
+  pthread_mutex_unlock(&command_exchange_mutex);
 
-  return return_value;
+  TRACE("return");
+
+  return thread_execution_response_str(mrb, response, len);
 }
 
+/**
+ * @brief Runs the pending commands (of a given ID, 0 for every one) through
+ * the given block. As in _execute_binary, commands are taken under the lock
+ * but the block runs without it.
+ *
+ * @return true when the queue wasn't empty or false, otherwise
+ */
 static mrb_value
-mrb_thread_pub_sub_s__publish(mrb_state *mrb, mrb_value self)
+mrb_thread_scheduler_s__execute(mrb_state *mrb, mrb_value self)
 {
-  mrb_int len = 0;
-  mrb_value target_id;
-  mrb_value buf;
-  mrb_value return_value;
+  mrb_int id = 0, thread = THREAD_COMMUNICATION, i;
+  mrb_value block, pending, obj;
+  threadExecutionQueue *queue;
+  executionMessage *snapshot = NULL, *message;
+  int ai, count = 0, size = 0;
 
   TRACE_FUNCTION();
 
-  pthread_mutex_lock(&message_exchange_mutex);
-
-  mrb_get_args(mrb, "So", &buf, &target_id);
+  mrb_get_args(mrb, "i|i&", &id, &thread, &block);
 
-  if (mrb_string_p(buf)) {
-    if (mrb_fixnum_p(target_id)) {
-      len = pubsub_publish(RSTRING_PTR(buf), RSTRING_LEN(buf), mrb_fixnum(target_id));
-    } else {
-      len = pubsub_publish(RSTRING_PTR(buf), RSTRING_LEN(buf), -1);
-    }
-  }
-  if (len > 0 )
-    return_value = mrb_true_value();
-  else
-    return_value = mrb_false_value();
+  thread_worker_check(mrb);
 
-  TRACE("return");
+  pthread_mutex_lock(&command_exchange_mutex);
 
-  pthread_mutex_unlock(&message_exchange_mutex);
-  return return_value;
-}
+  queue = thread_worker_queue(thread);
 
-static mrb_value
-mrb_thread_pub_sub_s__subscribe(mrb_state *mrb, mrb_value self)
-{
-  mrb_value return_value;
+  if (queue != NULL) size = queue->size;
 
-  TRACE_FUNCTION();
+  if (!mrb_nil_p(block) && size > 0) snapshot = thread_execution_snapshot(queue, id, 0, &count);
 
-  pthread_mutex_lock(&message_exchange_mutex);
+  pthread_mutex_unlock(&command_exchange_mutex);
 
-  return_value = mrb_fixnum_value(subscribe());
+  if (mrb_nil_p(block) || size == 0)
+  {
+    TRACE("return");
 
-  TRACE("return");
+    return mrb_false_value();
+  }
 
-  pthread_mutex_unlock(&message_exchange_mutex);
+  pending = thread_execution_pending(mrb, snapshot, count);
 
-  return return_value;
-}
+  for (i = 0; i + 2 < RARRAY_LEN(pending); i += 3)
+  {
+    ai = mrb_gc_arena_save(mrb);
 
-static mrb_value
-mrb_thread_scheduler_s__check(mrb_state *mrb, mrb_value self)
-{
-  mrb_int status = 0, id = 0, ret = 1, timeout = 0;
-  mrb_value return_value;
+    obj = mrb_yield(mrb, block, RARRAY_PTR(pending)[i + 2]);
 
-  TRACE_FUNCTION();
+    if (mrb_string_p(obj))
+    {
+      pthread_mutex_lock(&command_exchange_mutex);
 
-  pthread_mutex_lock(&message_exchange_mutex);
+      /* Unless dropped (restart) or already answered meanwhile */
+      message = thread_execution_find(thread_worker_queue(thread), mrb_fixnum(RARRAY_PTR(pending)[i]));
 
-  mrb_get_args(mrb, "ii", &id, &timeout);
+      if (message != NULL && message->executed == 0)
+      {
+        thread_execution_enqueue(thread_worker_queue(thread), message->id, 1, RSTRING_PTR(obj), RSTRING_LEN(obj));
+      }
 
-  if (id == THREAD_STATUS_BAR && StatusBarThread) {
-    ret = context_thread_sem_wait(StatusBarThread, timeout);
-    if (ret == 1) {
-      status = StatusBarThread->status;
-      context_thread_sem_push(StatusBarThread);
-    }
-  } else if (id == THREAD_COMMUNICATION && CommunicationThread) {
-    ret = context_thread_sem_wait(CommunicationThread, timeout);
-    if (ret == 1) {
-      status = CommunicationThread->status;
-      context_thread_sem_push(CommunicationThread);
+      pthread_mutex_unlock(&command_exchange_mutex);
     }
-  } else {
-    status = THREAD_STATUS_DEAD;
-  }
 
-  if (ret == -1)
-    return_value = mrb_fixnum_value(THREAD_STATUS_BLOCK);
-  else
-    return_value = mrb_fixnum_value(status);
+    mrb_gc_arena_restore(mrb, ai);
+  }
 
   TRACE("return");
 
-  pthread_mutex_unlock(&message_exchange_mutex);
-
-  return return_value;
+  return mrb_true_value();
 }
 
+/**
+ * @brief Queues a binary command (encoded arguments) for an opcode.
+ *
+ * @return call ID, to pick the response up with _call_result, or nil when
+ * out of memory
+ */
 static mrb_value
-mrb_thread_scheduler_s__continue(mrb_state *mrb, mrb_value self)
+mrb_thread_scheduler_s__call(mrb_state *mrb, mrb_value self)
 {
-  mrb_int id = 0, ret = 0;
-  mrb_value return_value;
+  mrb_int opcode = 0;
+  mrb_value args;
+  int id;
 
   TRACE_FUNCTION();
 
-  pthread_mutex_lock(&message_exchange_mutex);
+  mrb_get_args(mrb, "iS", &opcode, &args);
 
-  mrb_get_args(mrb, "i", &id);
+  thread_worker_check(mrb);
 
-  if (id == THREAD_STATUS_BAR)
+  if (opcode <= 0 || opcode > CONTEXT_COMMAND_MAX_OPCODE)
   {
-    ret = context_thread_continue(StatusBarThread);
-  }
-  else if (id == THREAD_COMMUNICATION)
-  {
-    ret = context_thread_continue(CommunicationThread);
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid opcode (1 to %S)", mrb_fixnum_value(CONTEXT_COMMAND_MAX_OPCODE));
   }
 
-  if (ret == 1)
-    return_value = mrb_true_value();
-  else
-    return_value = mrb_false_value();
+  pthread_mutex_lock(&command_exchange_mutex);
 
-  TRACE("return");
+  id = thread_execution_call(opcodeQueue, opcode, RSTRING_PTR(args), RSTRING_LEN(args));
 
-  pthread_mutex_unlock(&message_exchange_mutex);
+  pthread_mutex_unlock(&command_exchange_mutex);
 
-  return return_value;
+  TRACE("return");
+
+  return (id) ? mrb_fixnum_value(id) : mrb_nil_value();
 }
 
+/**
+ * @brief Takes the response of a call out of the queue, still encoded.
+ *
+ * @return response, nil while the call hasn't run yet or false, when there's
+ * no such call (already answered or dropped on restart)
+ */
 static mrb_value
-mrb_thread_scheduler_s__pause(mrb_state *mrb, mrb_value self)
+mrb_thread_scheduler_s__call_result(mrb_state *mrb, mrb_value self)
 {
-  mrb_int id = 0, pause = 0;
+  mrb_int id = 0;
+  executionMessage *message;
   mrb_value return_value;
+  char *response = NULL;
+  int len = 0, found;
 
-  TRACE_FUNCTION();
+  mrb_get_args(mrb, "i", &id);
 
-  pthread_mutex_lock(&message_exchange_mutex);
+  pthread_mutex_lock(&command_exchange_mutex);
 
-  mrb_get_args(mrb, "i", &id);
+  message = thread_execution_find(opcodeQueue, id);
 
-  if (id == THREAD_STATUS_BAR)
-    pause = context_thread_pause(StatusBarThread);
-  else if (id == THREAD_COMMUNICATION)
-    pause = context_thread_pause(CommunicationThread);
+  found = (message != NULL);
 
-  if (pause == 1)
-    return_value = mrb_true_value();
-  else
-    return_value = mrb_false_value();
+  if (found && message->executed == 1)
+  {
+    /* Detached from the queue here, copied to the calling state unlocked */
+    response = message->response;
+    len = message->responseLen;
 
-  TRACE("return");
+    message->response = NULL;
 
-  pthread_mutex_unlock(&message_exchange_mutex);
+    thread_execution_remove(opcodeQueue, id);
+  }
+
+  pthread_mutex_unlock(&command_exchange_mutex);
+
+  if (!found) return mrb_false_value();
+
+  if (response == NULL) return mrb_nil_value();
+
+  return_value = mrb_str_new(mrb, response, len);
+
+  free(response);
 
   return return_value;
 }
 
+/**
+ * @brief Runs the pending binary commands (of a given opcode, 0 for every
+ * one): the native handler of the opcode, when registered, or the given block
+ * (opcode, args). Commands are taken under the lock, but handlers run
+ * without it. Responses are stored under their call IDs.
+ *
+ * @return true when there was something to run or false, otherwise
+ */
 static mrb_value
-mrb_thread_scheduler_s__start(mrb_state *mrb, mrb_value self)
+mrb_thread_scheduler_s__execute_binary(mrb_state *mrb, mrb_value self)
 {
-  int i;
-  mrb_int id = 0;
-  mrb_value return_value;
+  mrb_int id = 0, i, opcode, call;
+  mrb_value block, pending, args, ret, argv[2];
+  executionMessage *snapshot;
+  commandHandler handler;
+  char *buf;
+  size_t len;
+  int ai, count;
 
   TRACE_FUNCTION();
 
-  pthread_mutex_lock(&message_exchange_mutex);
+  mrb_get_args(mrb, "i&", &id, &block);
 
-  mrb_get_args(mrb, "i", &id);
+  thread_worker_check(mrb);
 
-  return_value = mrb_true_value();
-
-  if (id == THREAD_STATUS_BAR) {
-    if (StatusBarThread) free(StatusBarThread);
-    StatusBarThread = context_thread_new(id, THREAD_FREE);
-    context_thread_sem_push(StatusBarThread);
-  } else if (id == THREAD_COMMUNICATION) {
-    if (CommunicationThread) {
-      context_thread_sem_wait(CommunicationThread, 0);
-      free(CommunicationThread);
-      CommunicationThread = NULL;
-    }
+  pthread_mutex_lock(&command_exchange_mutex);
 
-    i = 0;
+  snapshot = thread_execution_snapshot(opcodeQueue, 0, id, &count);
 
-    while (i < QUEUE_MAX_SIZE && message_send_queue[i])
-    {
-      free(message_send_queue[i]);
+  pthread_mutex_unlock(&command_exchange_mutex);
 
-      message_send_queue[i++] = NULL;
-    }
+  pending = thread_execution_pending(mrb, snapshot, count);
 
-    i = 0;
+  for (i = 0; i + 2 < RARRAY_LEN(pending); i += 3)
+  {
+    ai = mrb_gc_arena_save(mrb);
 
-    while (i < QUEUE_MAX_SIZE && message_recv_queue[i])
-    {
-      free(message_recv_queue[i]);
+    call = mrb_fixnum(RARRAY_PTR(pending)[i]);
 
-      message_recv_queue[i++] = NULL;
-    }
+    opcode = mrb_fixnum(RARRAY_PTR(pending)[i + 1]);
+
+    args = RARRAY_PTR(pending)[i + 2];
+    args = context_value_load(mrb, RSTRING_PTR(args), RSTRING_LEN(args));
+
+    if (!mrb_array_p(args)) args = mrb_ary_new(mrb);
 
     pthread_mutex_lock(&command_exchange_mutex);
 
-    if (executionQueue)
-    {
-      thread_execution_clean(executionQueue);
+    handler = command_handlers[opcode];
+
+    pthread_mutex_unlock(&command_exchange_mutex);
 
-      free(executionQueue);
+    if (handler.handler != NULL)
+      ret = handler.handler(mrb, opcode, args, handler.data);
+    else if (!mrb_nil_p(block))
+    {
+      argv[0] = mrb_fixnum_value(opcode);
+      argv[1] = args;
 
-      executionQueue = NULL;
+      ret = mrb_yield_argv(mrb, block, 2, argv);
     }
+    else
+      ret = mrb_nil_value();
 
-    executionQueue = thread_execution_new();
+    if (!context_value_transferable(ret)) ret = mrb_true_value();
 
-    pthread_mutex_unlock(&command_exchange_mutex);
+    if (context_value_dump(mrb, ret, &buf, &len) >= 0)
+    {
+      pthread_mutex_lock(&command_exchange_mutex);
 
-    CommunicationThread = context_thread_new(id, THREAD_FREE);
+      /* Unless dropped meanwhile (restart) */
+      if (thread_execution_find(opcodeQueue, call) != NULL)
+      {
+        thread_execution_enqueue(opcodeQueue, call, 1, buf, len);
+      }
 
-    context_thread_sem_push(CommunicationThread);
-  } else {
-    return_value = mrb_false_value();
+      pthread_mutex_unlock(&command_exchange_mutex);
+
+      free(buf);
+    }
+
+    mrb_gc_arena_restore(mrb, ai);
   }
 
   TRACE("return");
 
-  pthread_mutex_unlock(&message_exchange_mutex);
-
-  return return_value;
+  return mrb_bool_value(RARRAY_LEN(pending) > 0);
 }
 
+/**
+ * @brief Queues a command (string command ID or binary opcode) and returns a
+ * ThreadScheduler::Request to wait for its response, instead of polling.
+ * Raises when it can't be queued (worker not started), rather than handing
+ * out a request nothing will ever answer.
+ */
 static mrb_value
-mrb_thread_scheduler_s__stop(mrb_state *mrb, mrb_value self)
+mrb_thread_scheduler_s__request(mrb_state *mrb, mrb_value self)
 {
-  mrb_int i = 0, id = 0;
-  mrb_value return_value;
+  mrb_int id = 0, binary = 0, thread = THREAD_COMMUNICATION;
+  mrb_value command, request;
+  threadExecutionQueue *queue;
+  executionMessage *message;
+  commandRequest *pending;
+  struct RData *data;
+  int queued = 0;
 
   TRACE_FUNCTION();
 
-  pthread_mutex_lock(&message_exchange_mutex);
+  mrb_get_args(mrb, "iSi|i", &id, &command, &binary, &thread);
 
-  mrb_get_args(mrb, "i", &id);
+  thread_worker_check(mrb);
 
-  if (id == THREAD_STATUS_BAR && StatusBarThread) {
-    context_thread_sem_wait(StatusBarThread, 0);
-    StatusBarThread->status = THREAD_STATUS_DEAD;
-    context_thread_sem_push(StatusBarThread);
-  } else if (id == THREAD_COMMUNICATION && CommunicationThread) {
-    context_thread_sem_wait(CommunicationThread, 0);
-    CommunicationThread->status = THREAD_STATUS_DEAD;
+  if (binary && (id <= 0 || id > CONTEXT_COMMAND_MAX_OPCODE))
+  {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid opcode (1 to %S)", mrb_fixnum_value(CONTEXT_COMMAND_MAX_OPCODE));
+  }
 
-    while (i < QUEUE_MAX_SIZE && message_send_queue[i])
-    {
-      free(message_send_queue[i]);
+  /* Object first, so the record is never left behind by a failed allocation */
+  data = mrb_data_object_alloc(mrb, mrb_class_get_under(mrb, mrb_class_get(mrb, "ThreadScheduler"), "Request"), NULL, &command_request_type);
+  request = mrb_obj_value(data);
 
-      message_send_queue[i++] = NULL;
-    }
+  pending = (commandRequest *) mrb_malloc(mrb, sizeof(commandRequest));
 
-    i = 0;
+  pending->binary = (binary != 0);
+  pending->id = id;
+  pending->thread = thread;
+  pending->responses = 0;
 
-    while (i < QUEUE_MAX_SIZE && message_recv_queue[i])
-    {
-      free(message_recv_queue[i]);
+  data->data = pending;
 
-      message_recv_queue[i++] = NULL;
-    }
+  pthread_mutex_lock(&command_exchange_mutex);
 
-    i = 0;
+  if (pending->binary)
+  {
+    /* A call of its own, as _call */
+    pending->id = thread_execution_call(opcodeQueue, id, RSTRING_PTR(command), RSTRING_LEN(command));
 
-    while (conn_thread_events_marker[i])
-    {
-      thread_channel_clean(*conn_thread_events[i]);
+    queued = (pending->id != 0);
+  }
+  else if ((queue = thread_worker_queue(thread)) != NULL)
+  {
+    message = thread_execution_find(queue, id);
 
-      conn_thread_events_marker[i++] = 0;
-    };
+    if (message != NULL) pending->responses = message->responses;
 
-    context_thread_sem_push(CommunicationThread);
+    queued = (thread_execution_enqueue(queue, id, 0, RSTRING_PTR(command), RSTRING_LEN(command)) == RSTRING_LEN(command));
   }
 
-  return_value = mrb_true_value();
+  pthread_mutex_unlock(&command_exchange_mutex);
+
+  if (!queued)
+  {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "could not queue request (thread not started?)");
+  }
 
   TRACE("return");
 
-  pthread_mutex_unlock(&message_exchange_mutex);
+  return request;
+}
 
-  return return_value;
+/**
+ * @brief Fresh response of a request, when there's one. Must be called with
+ * @link command_exchange_mutex @endlink held.
+ */
+static executionMessage *
+command_request_response(commandRequest *pending)
+{
+  executionMessage *message;
+
+  message = thread_execution_find((pending->binary) ? opcodeQueue : thread_worker_queue(pending->thread), pending->id);
+
+  if (message == NULL || message->responses == pending->responses || message->executed != 1) return NULL;
+
+  return message;
 }
 
+/**
+ * @brief Waits for the response of a request.
+ *
+ * @param timeout milliseconds, negative to wait forever (default)
+ *
+ * @return true when answered or false, on timeout
+ */
 static mrb_value
-mrb_thread_scheduler_s__command(mrb_state *mrb, mrb_value self)
+mrb_request_wait(mrb_state *mrb, mrb_value self)
 {
-  mrb_value command;
-  char response[THREAD_COMMAND_MAX_MSG_SIZE] = {0x00};
-  mrb_int id = 0, len = 0;
-  mrb_value return_value;
-
-  TRACE_FUNCTION();
+  mrb_int timeout = -1;
+  commandRequest *pending = (commandRequest *) mrb_data_get_ptr(mrb, self, &command_request_type);
+  struct timespec deadline;
+  int ready;
 
-  pthread_mutex_lock(&command_exchange_mutex);
+  mrb_get_args(mrb, "|i", &timeout);
 
-  memset(response, 0, sizeof(response));
+  if (pending == NULL) return mrb_false_value();
 
-  mrb_get_args(mrb, "iS", &id, &command);
+  thread_deadline(&deadline, timeout);
 
-  len = thread_execution_get(executionQueue, id, 1, response);
-  thread_execution_enqueue(executionQueue, id, 0, RSTRING_PTR(command), RSTRING_LEN(command));
+  pthread_mutex_lock(&command_exchange_mutex);
 
-  if (len > 0) {
-    return_value = mrb_str_new(mrb, response, len);
-  } else {
-    return_value = mrb_str_new(mrb, "cache", 5);
+  while (command_request_response(pending) == NULL && timeout != 0)
+  {
+    if (timeout < 0)
+      pthread_cond_wait(&command_exchange_cond, &command_exchange_mutex);
+    else if (pthread_cond_timedwait(&command_exchange_cond, &command_exchange_mutex, &deadline) == ETIMEDOUT)
+      break;
   }
 
-  TRACE("return");
+  ready = (command_request_response(pending) != NULL);
 
   pthread_mutex_unlock(&command_exchange_mutex);
 
-  return return_value;
+  return mrb_bool_value(ready);
 }
 
+/**
+ * @brief Takes the raw response of a request out of the queue (still encoded
+ * for binary commands), so no later exchange picks it up.
+ *
+ * @return response or nil, when not answered yet or already taken (by a
+ * _command_once poller, for instance)
+ */
 static mrb_value
-mrb_thread_scheduler_s__command_once(mrb_state *mrb, mrb_value self)
+mrb_request__value(mrb_state *mrb, mrb_value self)
 {
-  mrb_value command;
-  char response[THREAD_COMMAND_MAX_MSG_SIZE] = {0x00};
-  char trash[THREAD_COMMAND_MAX_MSG_SIZE] = {0x00};
-  mrb_int id = 0, len = 0;
+  commandRequest *pending = (commandRequest *) mrb_data_get_ptr(mrb, self, &command_request_type);
+  executionMessage *message;
   mrb_value return_value;
+  char *response = NULL;
+  int len = 0;
 
-  TRACE_FUNCTION();
+  if (pending == NULL) return mrb_nil_value();
 
   pthread_mutex_lock(&command_exchange_mutex);
 
-  memset(response, 0, sizeof(response));
+  message = command_request_response(pending);
+
+  if (message != NULL && message->responseLen > 0)
+  {
+    len = message->responseLen;
+
+    pending->responses = message->responses;
 
-  mrb_get_args(mrb, "iS", &id, &command);
+    if (pending->binary)
+    {
+      /* The call ID is the request's own, the whole call goes */
+      response = message->response;
 
-  len = thread_execution_dequeue(executionQueue, id, 1, response);
-  if (len == 0) {
-    thread_execution_enqueue(executionQueue, id, 0, RSTRING_PTR(command), RSTRING_LEN(command));
-  } else {
-    thread_execution_dequeue(executionQueue, id, 0, trash);
-  }
+      message->response = NULL;
 
-  if (len > 0) {
-    return_value = mrb_str_new(mrb, response, len);
-  } else {
-    return_value = mrb_str_new(mrb, "cache", 5);
+      thread_execution_remove(opcodeQueue, pending->id);
+    }
+    else
+    {
+      response = thread_execution_take(thread_worker_queue(pending->thread), pending->id, &len);
+    }
   }
 
-  TRACE("return");
-
   pthread_mutex_unlock(&command_exchange_mutex);
 
+  if (response == NULL) return mrb_nil_value();
+
+  return_value = mrb_str_new(mrb, response, len);
+
+  free(response);
+
   return return_value;
 }
 
 static mrb_value
-mrb_thread_scheduler_s__execute(mrb_state *mrb, mrb_value self)
+mrb_request_binary_p(mrb_state *mrb, mrb_value self)
 {
-  mrb_int id = 0, len = 0;
-  mrb_value block, obj;
-  char command[THREAD_COMMAND_MAX_MSG_SIZE] = {0x00};
-  executionMessage *local = NULL;
+  commandRequest *pending = (commandRequest *) mrb_data_get_ptr(mrb, self, &command_request_type);
 
-  TRACE_FUNCTION();
-
-  pthread_mutex_lock(&command_exchange_mutex);
-
-  mrb_get_args(mrb, "i&", &id, &block);
-
-  if (mrb_nil_p(block) && executionQueue != NULL)
-  {
-    TRACE("return");
-
-    pthread_mutex_unlock(&command_exchange_mutex);
-
-    return mrb_false_value();
-  }
+  return mrb_bool_value(pending != NULL && pending->binary);
+}
 
-  if (executionQueue && executionQueue->size > 0) {
-    local = executionQueue->first;
-    while (local != NULL) {
-      if (local->executed == 0 && local->commandLen > 0 && (id == 0 || local->id == id)) {
-        len = thread_execution_get(executionQueue, local->id, 0, command);
-        if (len > 0) {
-          /* maybe free this obj */ /* <- ??? */
-          obj = mrb_yield(mrb, block, mrb_str_new(mrb, command, len));
-          if (mrb_string_p(obj)) {
-            thread_execution_enqueue(executionQueue, local->id, 1, RSTRING_PTR(obj), RSTRING_LEN(obj));
-          }
-        }
-      }
-      local = local->rear;
-    }
-  } else {
-    TRACE("return");
+/********************/
+/* Public functions */
+/********************/
 
-    pthread_mutex_unlock(&command_exchange_mutex);
+/**
+ * @brief Registers the native handler of a binary command opcode, replacing
+ * any previous one (NULL unregisters it).
+ *
+ * @return 1 on success or 0, when the opcode is out of range
+ */
+extern int
+context_command_register(mrb_int opcode, context_command_handler handler, void *data)
+{
+  if (opcode <= 0 || opcode > CONTEXT_COMMAND_MAX_OPCODE) return 0;
 
-    return mrb_false_value();
-  }
+  pthread_mutex_lock(&command_exchange_mutex);
 
-  TRACE("return");
+  command_handlers[opcode].handler = handler;
+  command_handlers[opcode].data = data;
 
   pthread_mutex_unlock(&command_exchange_mutex);
 
-  return mrb_true_value();
+  return 1;
 }
 
-/********************/
-/* Public functions */
-/********************/
-
 extern void
 mrb_thread_scheduler_init(mrb_state *mrb)
 {
@@ -1099,17 +3145,35 @@ mrb_thread_scheduler_init(mrb_state *mrb)
 
   struct RClass *thread_scheduler;
   struct RClass *thread_channel;
-  struct RClass *thread_pub_sub;
+  struct RClass *request;
   struct RClass *context;
 
   TRACE_FUNCTION();
 
   if (!mutex_init)
   {
-    pthread_mutex_init(&message_exchange_mutex, NULL);
+    pthread_mutex_init(&channel_registry_mutex, NULL);
+
+    pthread_mutex_init(&thread_control_mutex, NULL);
+
+    thread_cond_init(&thread_exit_cond);
+
+    thread_cond_init(&supervisor_cond);
 
     pthread_mutex_init(&command_exchange_mutex, NULL);
 
+    thread_cond_init(&command_exchange_cond);
+
+    pthread_mutex_init(&message_pool_mutex, NULL);
+
+    thread_worker_register("status_bar");    /* THREAD_STATUS_BAR */
+
+    thread_worker_register("communication"); /* THREAD_COMMUNICATION */
+
+    thread_channel_create("send", QUEUE_MAX_SIZE, NULL); /* CHANNEL_SEND */
+
+    thread_channel_create("recv", QUEUE_MAX_SIZE, NULL); /* CHANNEL_RECV */
+
     mutex_init = 1;
   }
 
@@ -1119,24 +3183,45 @@ mrb_thread_scheduler_init(mrb_state *mrb)
 
   mrb_define_class_method(mrb , thread_channel   , "_read"      , mrb_thread_channel_s__read      , MRB_ARGS_REQ(3));
   mrb_define_class_method(mrb , thread_channel   , "_write"     , mrb_thread_channel_s__write     , MRB_ARGS_REQ(4));
-
-  thread_pub_sub   = mrb_define_class_under(mrb, context, "ThreadPubSub", mrb->object_class);
-
-  mrb_define_class_method(mrb , thread_pub_sub   , "_listen"    , mrb_thread_pub_sub_s__listen    , MRB_ARGS_REQ(1));
-  mrb_define_class_method(mrb , thread_pub_sub   , "_publish"   , mrb_thread_pub_sub_s__publish   , MRB_ARGS_REQ(2));
-  mrb_define_class_method(mrb , thread_pub_sub   , "_subscribe" , mrb_thread_pub_sub_s__subscribe , MRB_ARGS_NONE());
+  mrb_define_class_method(mrb , thread_channel   , "_generate_id" , mrb_thread_channel_s__generate_id , MRB_ARGS_NONE());
+  mrb_define_class_method(mrb , thread_channel   , "_create"    , mrb_thread_channel_s__create    , MRB_ARGS_ARG(1, 1));
+  mrb_define_class_method(mrb , thread_channel   , "_create_shared" , mrb_thread_channel_s__create_shared , MRB_ARGS_ARG(2, 1));
+  mrb_define_class_method(mrb , thread_channel   , "_find"      , mrb_thread_channel_s__find      , MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb , thread_channel   , "_wait"      , mrb_thread_channel_s__wait      , MRB_ARGS_ARG(1, 1));
+  mrb_define_class_method(mrb , thread_channel   , "_drain"     , mrb_thread_channel_s__drain     , MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb , thread_channel   , "_write_batch" , mrb_thread_channel_s__write_batch , MRB_ARGS_REQ(3));
 
   thread_scheduler = mrb_define_class(mrb , "ThreadScheduler" , mrb->object_class);
 
-  mrb_define_class_method(mrb , thread_scheduler , "_check"    , mrb_thread_scheduler_s__check    , MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb , thread_scheduler , "_check"    , mrb_thread_scheduler_s__check    , MRB_ARGS_ARG(1, 1));
   mrb_define_class_method(mrb , thread_scheduler , "_continue" , mrb_thread_scheduler_s__continue , MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb , thread_scheduler , "_pause"    , mrb_thread_scheduler_s__pause    , MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb , thread_scheduler , "_start"    , mrb_thread_scheduler_s__start    , MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb , thread_scheduler , "_stop"     , mrb_thread_scheduler_s__stop     , MRB_ARGS_REQ(1));
-
-  mrb_define_class_method(mrb , thread_scheduler , "_command"  , mrb_thread_scheduler_s__command  , MRB_ARGS_REQ(2));
-  mrb_define_class_method(mrb , thread_scheduler , "_command_once" , mrb_thread_scheduler_s__command_once , MRB_ARGS_REQ(2));
-  mrb_define_class_method(mrb , thread_scheduler , "_execute"  , mrb_thread_scheduler_s__execute  , MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb , thread_scheduler , "_register" , mrb_thread_scheduler_s__register , MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb , thread_scheduler , "_find"     , mrb_thread_scheduler_s__find     , MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb , thread_scheduler , "_workers"  , mrb_thread_scheduler_s__workers  , MRB_ARGS_NONE());
+  mrb_define_class_method(mrb , thread_scheduler , "_spawn"    , mrb_thread_scheduler_s__spawn    , MRB_ARGS_ARG(2, 1));
+  mrb_define_class_method(mrb , thread_scheduler , "_join"     , mrb_thread_scheduler_s__join     , MRB_ARGS_ARG(1, 1));
+  mrb_define_class_method(mrb , thread_scheduler , "_heartbeat" , mrb_thread_scheduler_s__heartbeat , MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb , thread_scheduler , "_supervisor_stats" , mrb_thread_scheduler_s__supervisor_stats , MRB_ARGS_REQ(1));
+
+  mrb_define_class_method(mrb , thread_scheduler , "_command"  , mrb_thread_scheduler_s__command  , MRB_ARGS_ARG(2, 1));
+  mrb_define_class_method(mrb , thread_scheduler , "_command_once" , mrb_thread_scheduler_s__command_once , MRB_ARGS_ARG(2, 1));
+  mrb_define_class_method(mrb , thread_scheduler , "_execute"  , mrb_thread_scheduler_s__execute  , MRB_ARGS_ARG(1, 1));
+
+  mrb_define_class_method(mrb , thread_scheduler , "_call"     , mrb_thread_scheduler_s__call     , MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb , thread_scheduler , "_call_result" , mrb_thread_scheduler_s__call_result , MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb , thread_scheduler , "_execute_binary" , mrb_thread_scheduler_s__execute_binary , MRB_ARGS_REQ(1) | MRB_ARGS_BLOCK());
+  mrb_define_class_method(mrb , thread_scheduler , "_request"  , mrb_thread_scheduler_s__request  , MRB_ARGS_ARG(3, 1));
+
+  request          = mrb_define_class_under(mrb, thread_scheduler, "Request", mrb->object_class);
+
+  MRB_SET_INSTANCE_TT(request, MRB_TT_DATA);
+
+  mrb_define_method(mrb , request , "wait"    , mrb_request_wait     , MRB_ARGS_OPT(1));
+  mrb_define_method(mrb , request , "_value"  , mrb_request__value   , MRB_ARGS_NONE());
+  mrb_define_method(mrb , request , "binary?" , mrb_request_binary_p , MRB_ARGS_NONE());
 
   TRACE("return");
 }
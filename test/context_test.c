@@ -0,0 +1,101 @@
+/**
+ * @file context_test.c
+ * @brief mruby-context test helpers (ContextTest module), compiled only into
+ * the gem test states.
+ * @platform Pax Prolin
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026 CloudWalk, Inc.
+ *
+ */
+
+#include <stdio.h>
+
+#include "mruby.h"
+#include "mruby/compile.h"
+#include "mruby/dump.h"
+#include "mruby/proc.h"
+#include "mruby/string.h"
+
+/*********************/
+/* Private functions */
+/*********************/
+
+/**
+ * @brief RITE binary of a given snippet, as mrbc would write it.
+ */
+static mrb_value
+mrb_context_test_s_dump_irep(mrb_state *mrb, mrb_value self)
+{
+  mrb_value code, proc, binary;
+  mrbc_context *cxt;
+  uint8_t *bin = NULL;
+  size_t len = 0;
+  int ret;
+
+  mrb_get_args(mrb, "S", &code);
+
+  cxt = mrbc_context_new(mrb);
+  cxt->no_exec = TRUE;
+
+  proc = mrb_load_nstring_cxt(mrb, RSTRING_PTR(code), RSTRING_LEN(code), cxt);
+
+  mrbc_context_free(mrb, cxt);
+
+  if (mrb_type(proc) != MRB_TT_PROC) {
+    mrb_raise(mrb, E_SCRIPT_ERROR, "could not compile snippet");
+  }
+
+  ret = mrb_dump_irep(mrb, ((struct RProc *) mrb_ptr(proc))->body.irep, DUMP_ENDIAN_NAT, &bin, &len);
+
+  if (ret != MRB_DUMP_OK) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "could not dump irep");
+  }
+
+  binary = mrb_str_new(mrb, (const char *) bin, len);
+
+  mrb_free(mrb, bin);
+
+  return binary;
+}
+
+/**
+ * @brief Writes a given buffer to a file (the gem tests don't depend on
+ * mruby-io).
+ */
+static mrb_value
+mrb_context_test_s_write_file(mrb_state *mrb, mrb_value self)
+{
+  mrb_value path, buf;
+  FILE *file;
+  size_t len;
+
+  mrb_get_args(mrb, "SS", &path, &buf);
+
+  file = fopen(mrb_string_value_cstr(mrb, &path), "wb");
+
+  if (file == NULL) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "could not open %S", path);
+  }
+
+  len = fwrite(RSTRING_PTR(buf), 1, RSTRING_LEN(buf), file);
+
+  fclose(file);
+
+  return mrb_fixnum_value(len);
+}
+
+/********************/
+/* Public functions */
+/********************/
+
+void
+mrb_mruby_context_gem_test(mrb_state *mrb)
+{
+  struct RClass *context_test;
+
+  context_test = mrb_define_module(mrb, "ContextTest");
+
+  mrb_define_class_method(mrb , context_test , "dump_irep"  , mrb_context_test_s_dump_irep  , MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb , context_test , "write_file" , mrb_context_test_s_write_file , MRB_ARGS_REQ(2));
+}
@@ -0,0 +1,30 @@
+##
+# Context::Value
+
+assert('Context::Value round trip') do
+  value = [nil, true, false, 42, -1.5, "a\0b", :sym, {"k" => [1, {:n => nil}]}]
+  assert_equal value, Context::Value.load(Context::Value.dump(value))
+end
+
+assert('Context::Value not transferable') do
+  assert_raise(TypeError) do
+    Context::Value.dump(Object.new)
+  end
+end
+
+assert('Context::Value malformed') do
+  assert_raise(ArgumentError) do
+    Context::Value.load("a\x05")
+  end
+end
+
+assert('Context::Value results that are not transferable') do
+  assert_raise(TypeError) do
+    Context::Value.dump([1, Object.new])
+  end
+
+  # Handed over by mrb_eval: true at the top level, nil when nested
+  assert_true mrb_eval("Object.new", "transfer_test")
+  assert_equal [nil, 1, {:k => nil}], mrb_eval("[Object.new, 1, {:k => Object.new}]", "transfer_test")
+  mrb_stop("transfer_test")
+end
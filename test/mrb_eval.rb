@@ -21,3 +21,60 @@ assert('Kernel#mrb_eval Isolated') do
   assert_equal $a, 10
 end
 
+
+assert('Kernel#mrb_eval compiled snippet cache') do
+  mrb_eval("1 + 1", "cache_test")
+  mrb_eval("1 + 1", "cache_test")
+  stats = Vm.instance("cache_test")
+  assert_true stats[:cache_hits] >= 1
+  assert_true stats[:cache_size] <= stats[:cache_capacity]
+  mrb_stop("cache_test")
+end
+
+assert('Kernel#mrb_eval_async') do
+  future = mrb_eval_async("'async' + '_value'", "async_test")
+  assert_true future.wait(5000)
+  assert_true future.ready?
+  assert_equal "async_value", future.value
+  mrb_stop("async_test")
+end
+
+assert('Kernel#mrb_eval copies results across instances') do
+  assert_equal [1, "a\0b", {:k => 2.5}], mrb_eval("[1, \"a\\0b\", {:k => 2.5}]", "copy_test")
+  mrb_stop("copy_test")
+end
+
+assert('Kernel#mrb_eval_irep') do
+  binary = ContextTest.dump_irep("['irep'].first * 2")
+  assert_equal "irepirep", mrb_eval_irep(binary, "irep_test")
+  assert_true Vm.instance("irep_test")[:load_irep_size] > 0
+  mrb_stop("irep_test")
+end
+
+assert('Kernel#mrb_eval_irep rejects truncated or corrupt binaries') do
+  binary = ContextTest.dump_irep("1 + 1")
+
+  assert_raise(ArgumentError) { mrb_eval_irep(binary[0, binary.size - 1], "irep_test") }
+  assert_raise(ArgumentError) { mrb_eval_irep("XXXX" + binary[4..-1], "irep_test") }
+  assert_raise(ArgumentError) { mrb_eval_irep("", "irep_test") }
+  mrb_stop("irep_test")
+end
+
+assert('Kernel#mrb_eval_file') do
+  path = "/tmp/mruby-context-test.mrb"
+  binary = ContextTest.dump_irep(":from_file")
+
+  ContextTest.write_file(path, binary)
+  assert_equal :from_file, mrb_eval_file(path, "irep_test")
+
+  ContextTest.write_file(path, binary[0, binary.size / 2])
+  assert_raise(ArgumentError) { mrb_eval_file(path, "irep_test") }
+  assert_raise(ArgumentError) { mrb_eval_file("/tmp/mruby-context-missing.mrb", "irep_test") }
+  mrb_stop("irep_test")
+end
+
+assert('Kernel#mrb_eval application name size') do
+  assert_raise(ArgumentError) { mrb_eval("1", "a" * 256) }
+  assert_equal 2, mrb_eval("1 + 1", "a" * 255)
+  mrb_stop("a" * 255)
+end
@@ -0,0 +1,67 @@
+##
+# ThreadChannel
+
+assert('ThreadChannel._generate_id') do
+  first = Context::ThreadChannel._generate_id
+  assert_true Context::ThreadChannel._generate_id > first
+end
+
+assert('ThreadChannel.read by event id') do
+  first  = Context::ThreadChannel._generate_id
+  second = Context::ThreadChannel._generate_id
+
+  Context::ThreadChannel.write(:recv, "first", first)
+  Context::ThreadChannel.write(:recv, "second", second)
+
+  assert_equal "first", Context::ThreadChannel.read(:recv, first)
+  assert_equal "second", Context::ThreadChannel.read(:recv, 0)
+  assert_nil Context::ThreadChannel.read(:recv, first)
+end
+
+assert('ThreadChannel.create') do
+  id = Context::ThreadChannel.create(:telemetry, 2)
+  assert_equal id, Context::ThreadChannel.create(:telemetry)
+
+  Context::ThreadChannel.write(:telemetry, "a", 1)
+  Context::ThreadChannel.write(:telemetry, "b", 2)
+  assert_equal 0, Context::ThreadChannel.write(:telemetry, "c", 3)
+  assert_equal "a", Context::ThreadChannel.read(:telemetry, 1)
+
+  assert_raise(Context::ThreadChannel::ChannelNotFound) do
+    Context::ThreadChannel.read(:not_created)
+  end
+end
+
+assert('ThreadChannel.write_batch and drain') do
+  Context::ThreadChannel.create(:batch)
+
+  assert_equal 3, Context::ThreadChannel.write_batch(:batch, ["a", "b", "c"], 7)
+  assert_equal [[7, "a"], [7, "b"]], Context::ThreadChannel.drain(:batch, 2)
+  assert_equal [[7, "c"]], Context::ThreadChannel.drain(:batch)
+  assert_equal [], Context::ThreadChannel.drain(:batch)
+end
+
+assert('ThreadChannel.wait') do
+  Context::ThreadChannel.create(:wait_test)
+
+  assert_false Context::ThreadChannel.wait(:wait_test, 10)
+  Context::ThreadChannel.write(:wait_test, "a", 1)
+  assert_true Context::ThreadChannel.wait(:wait_test, 10)
+end
+
+assert('ThreadChannel.create_shared') do
+  id = Context::ThreadChannel.create_shared(:shm_test, "/tmp/mruby-context-test-shm", 4096)
+  assert_kind_of Integer, id
+  Context::ThreadChannel.drain(:shm_test) # left over by an earlier run
+
+  assert_false Context::ThreadChannel.wait(:shm_test, 10)
+  assert_equal 5, Context::ThreadChannel.write(:shm_test, "first", 1)
+  assert_true Context::ThreadChannel.wait(:shm_test, 10)
+  assert_equal "first", Context::ThreadChannel.read(:shm_test, 0)
+  assert_nil Context::ThreadChannel.read(:shm_test, 0)
+
+  assert_equal 3, Context::ThreadChannel.write_batch(:shm_test, ["a", "b", "c"], 7)
+  assert_equal [[7, "a"], [7, "b"]], Context::ThreadChannel.drain(:shm_test, 2)
+  assert_equal [[7, "c"]], Context::ThreadChannel.drain(:shm_test)
+  assert_equal [], Context::ThreadChannel.drain(:shm_test)
+end
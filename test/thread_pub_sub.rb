@@ -0,0 +1,42 @@
+##
+# ThreadPubSub
+
+assert('ThreadPubSub.publish broadcasts') do
+  first  = Context::ThreadPubSub.subscribe(:broadcast_test)
+  second = Context::ThreadPubSub.subscribe(:broadcast_test)
+
+  assert_true Context::ThreadPubSub.publish("event", first, :broadcast_test)
+  assert_nil Context::ThreadPubSub.listen(first)
+  assert_equal "event", Context::ThreadPubSub.listen(second)
+
+  Context::ThreadPubSub.unsubscribe(first)
+  Context::ThreadPubSub.unsubscribe(second)
+end
+
+assert('ThreadPubSub drop policies') do
+  oldest = Context::ThreadPubSub.subscribe(:policy_test, 2, :drop_oldest)
+  newest = Context::ThreadPubSub.subscribe(:policy_test, 2, :drop_newest)
+
+  ["1", "2", "3"].each { |event| Context::ThreadPubSub.publish(event, -1, :policy_test) }
+
+  assert_equal 1, Context::ThreadPubSub.stats(oldest)[:dropped]
+  assert_equal 2, Context::ThreadPubSub.stats(newest)[:backlog]
+  assert_equal "2", Context::ThreadPubSub.listen(oldest)
+  assert_equal "1", Context::ThreadPubSub.listen(newest)
+
+  assert_true Context::ThreadPubSub.unsubscribe(oldest)
+  assert_true Context::ThreadPubSub.unsubscribe(newest)
+  assert_nil Context::ThreadPubSub.stats(oldest)
+end
+
+assert('ThreadPubSub topic name size and capacity') do
+  assert_raise(ArgumentError) { Context::ThreadPubSub.subscribe("t" * 64) }
+  assert_raise(ArgumentError) { Context::ThreadPubSub.subscribe("") }
+  assert_raise(ArgumentError) { Context::ThreadPubSub.publish("event", -1, "t" * 64) }
+  assert_raise(ArgumentError) { Context::ThreadPubSub.subscribe(:capacity_test, 100_000_000) }
+
+  id = Context::ThreadPubSub.subscribe("t" * 63)
+  assert_true Context::ThreadPubSub.publish("event", -1, "t" * 63)
+  assert_equal "event", Context::ThreadPubSub.listen(id)
+  Context::ThreadPubSub.unsubscribe(id)
+end
@@ -0,0 +1,192 @@
+##
+# ThreadScheduler
+
+assert('ThreadScheduler.call') do
+  ThreadScheduler._start(ThreadScheduler::THREAD_INTERNAL_COMMUNICATION)
+  ThreadScheduler.handle(42) { |a, b| [a + b, {:ok => true}] }
+
+  assert_nil ThreadScheduler.call(42, 1, 2)
+  assert_true ThreadScheduler.execute_binary
+  assert_equal [3, {:ok => true}], ThreadScheduler.call(42, 1, 2)
+
+  # Other arguments don't get the result of a pending call
+  assert_nil ThreadScheduler.call(42, 2, 2)
+  assert_nil ThreadScheduler.call(42, 3, 3)
+  ThreadScheduler.execute_binary
+  assert_equal [6, {:ok => true}], ThreadScheduler.call(42, 3, 3)
+  assert_equal [4, {:ok => true}], ThreadScheduler.call(42, 2, 2)
+
+  assert_raise(ArgumentError) do
+    ThreadScheduler.call(0)
+  end
+end
+
+assert('ThreadScheduler.request') do
+  ThreadScheduler._start(ThreadScheduler::THREAD_INTERNAL_COMMUNICATION)
+  ThreadScheduler.handle(43) { |a| a * 2 }
+
+  request = ThreadScheduler.request_call(43, 21)
+  assert_false request.wait(10)
+  ThreadScheduler.execute_binary
+  assert_true request.wait(10)
+  assert_equal 42, request.value
+  assert_equal 42, request.value
+  assert_false request.wait(0)
+end
+
+assert('ThreadScheduler::Request takes its response') do
+  ThreadScheduler._start(ThreadScheduler::THREAD_INTERNAL_COMMUNICATION)
+
+  request = ThreadScheduler.request(31, "ping")
+  assert_true ThreadScheduler._execute(31) { |str| str.upcase }
+  assert_equal "PING", request.value(10)
+  assert_equal "cache", ThreadScheduler._command_once(31, "ping")
+
+  request = ThreadScheduler.request(32, "ping")
+  ThreadScheduler._execute(32) { |str| str.upcase }
+  assert_equal "PING", ThreadScheduler._command_once(32, "ping")
+  assert_nil request.value(0)
+end
+
+assert('ThreadScheduler.pause? waits for continue!') do
+  ThreadScheduler._start(ThreadScheduler::THREAD_INTERNAL_COMMUNICATION)
+
+  assert_false ThreadScheduler.pause?(:communication)
+  assert_true ThreadScheduler.pause!(:communication)
+  assert_true ThreadScheduler.pause?(:communication, 20)
+  assert_true ThreadScheduler.continue!(:communication)
+  assert_false ThreadScheduler.pause?(:communication, 20)
+end
+
+assert('ThreadScheduler named workers') do
+  assert_equal [:status_bar, :communication], ThreadScheduler.workers[0, 2]
+  assert_raise(ThreadScheduler::ThreadSchedulerNotFoundError) do
+    ThreadScheduler.check(:printer)
+  end
+
+  id = ThreadScheduler._register("printer")
+  assert_equal :dead, ThreadScheduler.check(:printer)
+  ThreadScheduler._start(id)
+  assert_equal :alive, ThreadScheduler.check(:printer)
+
+  request = ThreadScheduler.send_to(:printer, 7, "ping")
+  assert_true ThreadScheduler.serve(:printer) { |str| str.upcase }
+  assert_equal "PING", request.value(10)
+
+  assert_true ThreadScheduler.pause!(:printer)
+  assert_equal :pause, ThreadScheduler.check(:printer)
+  assert_true ThreadScheduler.continue!(:printer)
+  ThreadScheduler.stop!(:printer)
+  assert_equal :dead, ThreadScheduler.check(:printer)
+end
+
+assert('ThreadScheduler supervisor') do
+  id = ThreadScheduler._register("beeper")
+  stats = ThreadScheduler.supervisor_stats[:beeper]
+  assert_false stats[:supervised]
+  assert_equal 0, stats[:restarts]
+  assert_nil stats[:failure]
+
+  assert_true ThreadScheduler.spawn(:beeper, "ThreadScheduler.heartbeat(:beeper)")
+  assert_true ThreadScheduler.supervised?(:beeper)
+
+  ThreadScheduler.stop!(:beeper)
+  assert_false ThreadScheduler.supervised?(:beeper)
+  assert_true ThreadScheduler._join(id, 5000)
+end
+
+assert('ThreadScheduler worker name size') do
+  count = ThreadScheduler.workers.size
+
+  assert_raise(ArgumentError) do
+    ThreadScheduler.spawn("w" * 32, "nil")
+  end
+  assert_raise(ArgumentError) do
+    ThreadScheduler._register("")
+  end
+  assert_equal count, ThreadScheduler.workers.size
+
+  id = ThreadScheduler._register("w" * 31)
+  assert_equal id, ThreadScheduler._register("w" * 31)
+  assert_equal id, ThreadScheduler.thread_id("w" * 31)
+end
+
+assert('ThreadScheduler supervisor restarts a stalled worker') do
+  Context::ThreadChannel.create(:stall_gate)
+  Context::ThreadChannel.create(:stall_out)
+  Context::ThreadChannel.create(:stall_wait) # never written, to sleep on
+  id = ThreadScheduler._register("staller")
+
+  # Only the first run stalls (blocked on the gate, no heartbeat), then
+  # writes the generation it ran as
+  code = "stats = ThreadScheduler._supervisor_stats(#{id}); "
+  code << "Context::ThreadChannel.wait(:stall_gate, 5000) if stats[:restarts] == 0; "
+  code << "Context::ThreadChannel.write(:stall_out, stats[:generation].to_s, 1)"
+
+  assert_true ThreadScheduler.spawn(:staller, code, 100)
+  first = ThreadScheduler._supervisor_stats(id)[:generation]
+
+  50.times do
+    break if ThreadScheduler._supervisor_stats(id)[:restarts] > 0
+    Context::ThreadChannel.wait(:stall_wait, 100)
+  end
+  stats = ThreadScheduler._supervisor_stats(id)
+  assert_true stats[:restarts] >= 1
+  assert_equal "stalled", stats[:failure]
+  assert_true stats[:generation] > first
+
+  # The stalled run wakes up detached: its write is refused
+  Context::ThreadChannel.write(:stall_gate, "go", 1)
+  Context::ThreadChannel.wait(:stall_wait, 200)
+  ThreadScheduler.stop!(:staller)
+  assert_true ThreadScheduler._join(id, 5000)
+
+  written = Context::ThreadChannel.drain(:stall_out).map { |_, generation| generation.to_i }
+  assert_false written.include?(first)
+end
+
+assert('ThreadScheduler.execute runs commands and binary calls') do
+  unless Object.const_defined?(:DaFunk)
+    module DaFunk
+      class PaymentChannel
+        class << self
+          attr_accessor :client
+        end
+      end
+    end
+  end
+  channel = Object.new
+  def channel.ping; "pong"; end
+  DaFunk::PaymentChannel.client = channel
+
+  ThreadScheduler._start(ThreadScheduler::THREAD_INTERNAL_COMMUNICATION)
+  ThreadScheduler.handle(44) { |a| a + 1 }
+
+  request = ThreadScheduler.request(5, "ping")
+  call = ThreadScheduler.request_call(44, 1)
+  assert_true ThreadScheduler.execute(5)
+  assert_equal "pong", request.value(10)
+  assert_equal 2, call.value(10)
+end
+
+assert('ThreadScheduler.send_to a worker not started') do
+  ThreadScheduler._register("idle")
+  assert_raise(RuntimeError) { ThreadScheduler.send_to(:idle, 1, "ping") }
+  assert_raise(RuntimeError) { ThreadScheduler.send_to(:not_registered, 1, "ping") }
+end
+
+assert('ThreadScheduler reuses the slots of stopped workers') do
+  ids = []
+  32.times do |i|
+    id = ThreadScheduler._register("slot_#{i}")
+    break if id < 0
+    ids << id
+  end
+  assert_equal(-1, ThreadScheduler._register("slot_full"))
+
+  ThreadScheduler._start(ids.last)
+  ThreadScheduler._stop(ids.last)
+  assert_equal ids.last, ThreadScheduler._register("slot_reused")
+  assert_nil ThreadScheduler.thread_id("slot_#{ids.size - 1}")
+  assert_equal :dead, ThreadScheduler.check(:slot_reused)
+end
@@ -0,0 +1,75 @@
+##
+# Vm
+
+assert('Vm.stats') do
+  stats = Vm.stats
+  assert_true stats[:peak_memory] >= stats[:current_memory]
+  assert_equal stats[:frees], stats[:free_not_null] + stats[:free_null]
+  assert_kind_of Array, stats[:histogram]
+end
+
+assert('Vm.stats slab chunks') do
+  before = mrb_eval("Vm.stats[:slab_chunks]", "slab_test")
+  after = mrb_eval("$small = Array.new(20_000) { |i| [i] }; Vm.stats[:slab_chunks]", "slab_test")
+  assert_true after > before
+  assert_true mrb_eval("$small = nil; GC.start; Vm.stats[:slab_chunks]", "slab_test") >= after
+  mrb_stop("slab_test")
+end
+
+assert('Vm.memory_limit') do
+  assert_false Vm.memory_limit("not_running", 0, 0)
+  assert_raise(ArgumentError) do
+    Vm.memory_limit("not_running", 2048, 1024)
+  end
+end
+
+assert('Vm.memory_limit soft limit collects') do
+  mrb_eval("nil", "soft_limit_test")
+  soft = Vm.instance("soft_limit_test")[:current_memory] + 64 * 1024
+  assert_true Vm.memory_limit("soft_limit_test", soft, 0)
+
+  # Garbage well over the limit, collected by the time the eval is over
+  mrb_eval("2000.times { 'x' * 1024 }; nil", "soft_limit_test")
+  assert_true Vm.instance("soft_limit_test")[:current_memory] <= soft
+  mrb_stop("soft_limit_test")
+end
+
+assert('Vm.memory_limit hard limit raises NoMemoryError') do
+  mrb_eval("nil", "hard_limit_test")
+  hard = Vm.instance("hard_limit_test")[:current_memory] + 256 * 1024
+  assert_true Vm.memory_limit("hard_limit_test", 0, hard)
+
+  code = "begin; 'x' * (1024 * 1024); false; rescue NoMemoryError; true; end"
+  assert_true mrb_eval(code, "hard_limit_test")
+  assert_true mrb_eval("Vm.stats[:rejected]", "hard_limit_test") > 0
+
+  # Still usable afterwards
+  assert_equal 2, mrb_eval("1 + 1", "hard_limit_test")
+  mrb_stop("hard_limit_test")
+end
+
+assert('Vm.instances') do
+  mrb_eval("1", "instances_test")
+  stats = Vm.instances.find { |instance| instance[:application] == "instances_test" }
+  assert_true stats[:evals] >= 1
+  assert_true stats[:peak_memory] >= stats[:current_memory]
+  assert_false stats[:outdated]
+  mrb_stop("instances_test")
+end
+
+assert('Vm.instance latency') do
+  mrb_eval("1 + 1", "latency_test")
+  latency = Vm.instance("latency_test")[:latency]
+
+  assert_true latency[:compile][:count] >= 1
+  assert_true latency[:execute][:count] >= 1
+  assert_true latency[:execute][:p50] <= latency[:execute][:max]
+  mrb_stop("latency_test")
+end
+
+assert('Vm.slow_eval_threshold') do
+  Vm.slow_eval_threshold = 1000000
+  assert_equal 1000000, Vm.slow_eval_threshold
+  Vm.slow_eval_threshold = 0
+  assert_equal 0, Vm.slow_eval_threshold
+end